@@ -29,6 +29,25 @@ int main(int argc, char **argv) {
   auto d2 = grad(x);
   cout << d2.eval(p) << endl;
 
+  // The gradient of a curl is differenced; row i is d/dx_i, as for grad(x)
+  VectorField v = cross(x, constant(Vec3(0,0,1))) * dot(x, x);
+  VectorField w = curl(v);
+  const Mat3 d3 = grad(w).eval(p);
+  Mat3 n3;
+  for(int i=0;i<3;++i) {
+    Vec3 e(0,0,0); e[i] = 1e-2f;
+    n3.row(i) = ((w.eval(p+e) - w.eval(p-e)) / 2e-2f).transpose();
+  }
+  cout << ((d3 - n3).norm() < 1e-2f * n3.norm()) << endl;
+
+  // Native kernels of different shapes in one process each run their own code
+  ScalarField j1 = jit(a3);
+  VectorField j2 = jit(v * a3 + x);
+  MatrixField j3 = jit(grad(x) * a3);
+  cout << (fabs(j1.eval(p) - a3.eval(p)) < 1e-5f * fabs(a3.eval(p))) << " "
+       << ((j2.eval(p) - (v * a3 + x).eval(p)).norm() < 1e-5f * (v * a3 + x).eval(p).norm()) << " "
+       << ((j3.eval(p) - (grad(x) * a3).eval(p)).norm() < 1e-5f * (grad(x) * a3).eval(p).norm()) << endl;
+
   // Can not take a spatial derivative of a matrix field though!
   // (This would generate a third-order tensor, which isn't supported (yet?)
   // auto d3 = grad(constant(Mat3(0,0,0)))
@@ -1,6 +1,7 @@
 #include <iostream>
 #include <cstdio>
 #include <chrono>
+#include <vector>
 #include "construct/Construct.h"
 using namespace Construct;
 using namespace std;
@@ -12,26 +13,41 @@ void render_ppm(const char *path, ScalarField field, VectorField color, Domain d
 	int H = 512;//domain.res[2] * 2;
 
 	fprintf(f,"P6\n%d %d\n255\n",W,H);
+	const float ds = domain.H[2] * .5f;
+	int Z = 0; // Number of samples along each ray
+	for(float z=domain.bmin[2];z<=domain.bmax[2];z+=ds) ++Z;
+
+	// Flatten both expressions once, then sample a whole scanline of rays at once
+	field = compile(field);
+	color = compile(color);
+	vector<Vec3> X(W * Z), col(W * Z);
+	vector<float> rho(W * Z);
 	for(int y=H-1;y>=0;--y) {
+		for(int x=0;x<W;++x) {
+			float z = domain.bmin[2];
+			for(int s=0;s<Z;++s,z+=ds) {
+				Vec3 &P = X[x*Z + s];
+				P[0] = domain.bmin[0] + domain.extent[0] * (float)x / (float)(W-1);
+				P[1] = domain.bmin[1] + domain.extent[1] * (float)y / (float)(H-1);
+				P[2] = z;
+			}
+		}
+		field.evalBlock(&X[0], &rho[0], W * Z);
+		color.evalBlock(&X[0], &col[0], W * Z);
+
 		for(int x=0;x<W;++x) {
 		
 			Vec3 C(0,0,0); // Output color
 			float T=1; // Transmittance
-			const float ds = domain.H[2] * .5f;
 
       // Ray march through the volume
-			for(float z=domain.bmin[2];z<=domain.bmax[2];z+=ds) {
-				Vec3 X;
-				X[0] = domain.bmin[0] + domain.extent[0] * (float)x / (float)(W-1);
-				X[1] = domain.bmin[1] + domain.extent[1] * (float)y / (float)(H-1);
-				X[2] = z;
-				float rho = field.eval(X);
-				if(rho <= 0) continue;
-				Vec3 col = color.eval(X);
+			for(int s=0;s<Z;++s) {
+				const float r = rho[x*Z + s];
+				if(r <= 0) continue;
 
-				const float dT = expf(rho * -ds);
+				const float dT = expf(r * -ds);
 				T *= dT;
-				C += (1.f-dT) * T * col;
+				C += (1.f-dT) * T * col[x*Z + s];
 			}
 			// Gamma adjust + convert to the [0,255] range
 			const float gamma = 1.f / 2.f;
@@ -45,10 +61,12 @@ void render_ppm(const char *path, ScalarField field, VectorField color, Domain d
 }
 
 // Semi-lagrangian advection by warping space along 
-// characteristic lines in the flow field
-template<typename T>
-Field<T> advect(Field<T> f, VectorField u, ScalarField dt) {
-	return warp(f, identity() - u * dt);
+// characteristic lines in the flow field. Built as a static
+// expression so each step bakes through one fused kernel.
+template<typename F, typename U>
+auto advect(const expr::Expr<F>& f, const expr::Expr<U>& u, float dt)
+  -> decltype(warp(f, expr::identity() - u * dt)) {
+	return warp(f, expr::identity() - u * dt);
 }
 
 // Signed distance function for a sphere
@@ -60,29 +78,35 @@ int main(int argc, char **argv) {
 	const unsigned int R = 128; // Resolution
   Domain domain(R, R, R, Vec3(-1,-1,-1), Vec3(1,1,1));
 
-  auto density = mask(sphere(Vec3(0,0,0), .8f));
-  auto velocity = constant(Vec3(0,0,0));
-	auto dt = constant(.1f);
+	// Gridded from the start, so the step kernels can sample them inline.
+	// One ghost cell keeps backtraces near the walls off the slow path.
+	// Each state is double-buffered, and the projection keeps its scratch
+	// grids, so time steps reuse the same memory throughout.
+	const int halo = 1;
+  GridBuffer<float> density(mask(sphere(Vec3(0,0,0), .8f)), constant(0.f), domain, halo);
+  GridBuffer<Vec3> velocity(constant(Vec3(0,0,0)), constant(Vec3(0,0,0)), domain, halo);
+  GridWorkspace workspace;
+  ConstructGrid<float> pressure(domain, constant(0.f).node); // Kept to warm start each projection
+	const float dt = .1f;
 
 	for(int iter=0; iter<1000; ++iter) {
 		//////////////////////////////////////////////////////////	
 		// Advect density using semi-lagrangian advection		
-		density = advect(density, velocity, dt);
-		density = writeToGrid(density, constant(0.f), domain);
+		expr::bake(density, advect(expr::sample(density.field()), expr::sample(velocity.field()), dt));
 
-		// Advect velocity similarly
-		velocity = advect(velocity, velocity, dt);
-    // Add force upward, proportional to density
-    velocity = velocity + dt * density * constant(Vec3(0,1,0));
+		// Advect velocity similarly, and add force upward, proportional to density
+		auto u = expr::sample(velocity.field());
+		auto forced = advect(u, u, dt) + dt * expr::sample(density.field()) * expr::constant(Vec3(0,1,0));
+		expr::bake(velocity, forced);
     // Div-Free Projection
-		velocity = divFree(velocity, constant(0.f), domain, 50);
+		velocity.front().divFree(constant(0.f), 50, workspace, pressure);
 		//////////////////////////////////////////////////////////	
 
 		// Output results
 		char path[256];
 		sprintf(path, "frame.%04d.ppm", iter);
-		ScalarField render_density = density ;
-		VectorField render_color = density * constant(Vec3(1,1,1));
+		ScalarField render_density = density.field();
+		VectorField render_color = render_density * constant(Vec3(1,1,1));
 		render_ppm(path, render_density, render_color, domain);
 
 		cout << "Finished time step " << iter+1 << endl;
@@ -2,6 +2,7 @@
 // (C) 2012
 
 #include "construct/ConstructBase.h"
+#include "construct/ConstructSIMD.h"
 #include "construct/ConstructField.h"
 #include "construct/ConstructArithmetic.h"
 #include "construct/ConstructAlgebra.h"
@@ -10,4 +11,8 @@
 
 #include "construct/ConstructDomain.h"
 #include "construct/ConstructGrid.h"
+#include "construct/ConstructSparseGrid.h"
+#include "construct/ConstructMACGrid.h"
 #include "construct/ConstructUtils.h"
+#include "construct/ConstructExpression.h"
+#include "construct/ConstructJIT.h"
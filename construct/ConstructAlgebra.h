@@ -1,6 +1,7 @@
 #ifndef ConstructAlgebra_h
 #define ConstructAlgebra_h
 #include "construct/ConstructField.h"
+#include "construct/ConstructSIMD.h"
 namespace Construct {
 
 /////////////////////////////////////
@@ -8,20 +9,122 @@ namespace Construct {
 // Identity field
 struct IdentityField : public VectorFieldNode {
   Vec3 eval(const Vec3& x) const { return x; }
+  void evalBlock(const Vec3* xs, Vec3* out, size_t n) const
+  { for(size_t i=0;i<n;++i) out[i] = xs[i]; }
+  int compile(FieldCompiler& c, int x) const { return x; }
+  int compileGrad(FieldCompiler& c, int x) const
+  { return c.constant(Mat3(Mat3::Identity())); }
   Mat3 grad(const Vec3& x) const { return Mat3::Identity(); }
+  ValueAndGrad<Vec3> evalWithGrad(const Vec3& x) const
+  { return ValueAndGrad<Vec3>(x, Mat3::Identity()); }
 };
 inline VectorField identity()
 { return new IdentityField(); }
 
+// Affine map A*x + b. Produced by simplify() out of translations and
+// arithmetic on identity(); the gradient is A^T, as for grids.
+struct AffineField : public VectorFieldNode {
+  Mat3 A;
+  Vec3 b;
+  bool translation; //! A is the identity
+  AffineField(const Mat3& A, const Vec3& b)
+  : A(A), b(b), translation(A == Mat3::Identity()) { }
+  Vec3 eval(const Vec3& x) const { return translation ? Vec3(x + b) : Vec3(A * x + b); }
+  void evalBlock(const Vec3* xs, Vec3* out, size_t n) const {
+    if(translation) for(size_t i=0;i<n;++i) out[i] = xs[i] + b;
+    else for(size_t i=0;i<n;++i) out[i] = A * xs[i] + b;
+  }
+  int compile(FieldCompiler& c, int x) const {
+    const int ax = translation ? x : c.emit<Vec3>(OpMulMV, c.bound(this, 0, A), x);
+    return c.emit<Vec3>(OpAddV, ax, c.bound(this, 1, b));
+  }
+  int compileGrad(FieldCompiler& c, int x) const
+  { return c.bound(this, 2, Mat3(A.transpose())); }
+  void shape(FieldShape& s) const {
+    s.bind(this, 0, A); s.bind(this, 1, b); s.bind(this, 2, Mat3(A.transpose()));
+    s.mix(translation);
+  }
+  Mat3 grad(const Vec3& x) const { return A.transpose(); }
+  ValueAndGrad<Vec3> evalWithGrad(const Vec3& x) const
+  { return ValueAndGrad<Vec3>(eval(x), A.transpose()); }
+};
+
+//! Recognizes identity(), constants and affine fields as x -> A*x + b
+inline bool asAffine(const VFNodePtr& v, Mat3& A, Vec3& b) {
+  if(dynamic_cast<const IdentityField*>(v.get())) 
+  { A = Mat3::Identity(); b = Vec3::Zero(); return true; }
+  if(const AffineField* f = dynamic_cast<const AffineField*>(v.get()))
+  { A = f->A; b = f->b; return true; }
+  if(const ConstantField<Vec3>* c = FieldSimplifier::constant(v))
+  { A = Mat3::Zero(); b = c->value; return true; }
+  return false;
+}
+
+//! The cheapest node for x -> A*x + b
+inline VFNodePtr affine(const Mat3& A, const Vec3& b) {
+  if(A == Mat3::Zero()) return adopt(new ConstantField<Vec3>(b));
+  if(A == Mat3::Identity() && b == Vec3::Zero()) return adopt(new IdentityField());
+  return adopt(new AffineField(A, b));
+}
+
+//! sa*a + sb*b as one affine map, when a and b are both affine and not
+//! both constant (constants fold on their own). Null otherwise.
+template<typename T>
+inline typename ConstructFieldNode<T>::ptr affineCombination(
+  const typename ConstructFieldNode<T>::ptr& a, real sa,
+  const typename ConstructFieldNode<T>::ptr& b, real sb)
+{ return typename ConstructFieldNode<T>::ptr(); }
+template<> inline VFNodePtr affineCombination<Vec3>(const VFNodePtr& a, real sa, const VFNodePtr& b, real sb) {
+  Mat3 Aa, Ab;
+  Vec3 ba, bb;
+  if(!asAffine(a, Aa, ba) || !asAffine(b, Ab, bb)) return VFNodePtr();
+  if(FieldSimplifier::constant(a) && FieldSimplifier::constant(b)) return VFNodePtr();
+  return affine(sa*Aa + sb*Ab, sa*ba + sb*bb);
+}
+
+//! M*a as one affine map when a is a non-constant affine map, else null
+template<typename T>
+inline typename ConstructFieldNode<T>::ptr affineProduct(const Mat3& M, const typename ConstructFieldNode<T>::ptr& a)
+{ return typename ConstructFieldNode<T>::ptr(); }
+template<> inline VFNodePtr affineProduct<Vec3>(const Mat3& M, const VFNodePtr& a) {
+  Mat3 A;
+  Vec3 b;
+  if(FieldSimplifier::constant(a) || !asAffine(a, A, b)) return VFNodePtr();
+  return affine(M*A, M*b);
+}
+
 // Length(vectorfield) field
 struct LengthField : public ScalarFieldNode {
   VFNodePtr v;
   LengthField(VFNodePtr v) : v(v) { }
   real eval(const Vec3& x) const { return v->eval(x).norm(); }
-  Vec3 grad(const Vec3& x) const { 
-    Vec3 ve = v->eval(x);
-    Mat3 vg = v->grad(x);
-    return ( vg.transpose() * ve ) / (static_cast<real>(1.e-5) + ve.norm()); 
+  void evalBlock(const Vec3* xs, real* out, size_t n) const {
+    Vec3 ve[BlockSize];
+    SoABlock soa;
+    v->evalBlock(xs, ve, n);
+    soa.load(ve, n);
+    simd::length(soa.x, soa.y, soa.z, out, n);
+  }
+  int compile(FieldCompiler& c, int x) const
+  { return c.emit<real>(OpLength, c.lower(*v, x)); }
+  int compileGrad(FieldCompiler& c, int x) const {
+    const int ve = c.lower(*v, x), vg = c.lowerGrad(*v, x);
+    const int num = c.emit<Vec3>(OpMulMV, c.emit<Mat3>(OpTranspose, vg), ve);
+    const int den = c.emit<real>(OpAddR, c.constant(static_cast<real>(1.e-5)), c.lower(*this, x));
+    return c.emit<Vec3>(OpDivV, num, den);
+  }
+  void shape(FieldShape& s) const
+  { s(v); }
+  SFNodePtr simplify(FieldSimplifier& s) const {
+    const VFNodePtr sv = s(v);
+    if(s.constant(sv)) return s.fold<real>(new LengthField(sv));
+    return sv == v ? SFNodePtr() : adopt(new LengthField(sv));
+  }
+  Vec3 grad(const Vec3& x) const { return evalWithGrad(x).grad; }
+  ValueAndGrad<real> evalWithGrad(const Vec3& x) const { 
+    const ValueAndGrad<Vec3> ve = v->evalWithGrad(x);
+    const real norm = ve.value.norm();
+    return ValueAndGrad<real>(norm, ( ve.grad.transpose() * ve.value ) / (static_cast<real>(1.e-5) + norm)); 
   }
 };
 inline ScalarField length(VectorField v)
@@ -32,8 +135,39 @@ struct InnerProductField : public ScalarFieldNode {
   VFNodePtr A, B;
   InnerProductField(VFNodePtr A, VFNodePtr B) : A(A), B(B) { }
   real eval(const Vec3& x) const { return A->eval(x).dot(B->eval(x)); }
-  Vec3 grad(const Vec3& x) const // TODO: Check for correctness 
-  { return A->grad(x).transpose()*B->eval(x) + B->grad(x).transpose()*A->eval(x); }
+  void evalBlock(const Vec3* xs, real* out, size_t n) const {
+    Vec3 a[BlockSize], b[BlockSize];
+    SoABlock sa, sb;
+    A->evalBlock(xs, a, n);
+    B->evalBlock(xs, b, n);
+    sa.load(a, n);
+    sb.load(b, n);
+    simd::dot(sa, sb, out, n);
+  }
+  int compile(FieldCompiler& c, int x) const {
+    const int a = c.lower(*A, x), b = c.lower(*B, x);
+    return c.emit<real>(OpDot, a, b);
+  }
+  int compileGrad(FieldCompiler& c, int x) const {
+    const int a = c.lower(*A, x), b = c.lower(*B, x);
+    const int ga = c.lowerGrad(*A, x), gb = c.lowerGrad(*B, x);
+    return c.emit<Vec3>(OpAddV,
+      c.emit<Vec3>(OpMulMV, c.emit<Mat3>(OpTranspose, ga), b),
+      c.emit<Vec3>(OpMulMV, c.emit<Mat3>(OpTranspose, gb), a));
+  }
+  void shape(FieldShape& s) const
+  { s(A); s(B); }
+  SFNodePtr simplify(FieldSimplifier& s) const {
+    const VFNodePtr a = s(A), b = s(B);
+    if(s.constant(a) && s.constant(b)) return s.fold<real>(new InnerProductField(a, b));
+    if(s.zero(a) || s.zero(b)) return adopt(new ConstantField<real>(0));
+    return a == A && b == B ? SFNodePtr() : adopt(new InnerProductField(a, b));
+  }
+  Vec3 grad(const Vec3& x) const { return evalWithGrad(x).grad; }
+  ValueAndGrad<real> evalWithGrad(const Vec3& x) const { // TODO: Check for correctness 
+    const ValueAndGrad<Vec3> a = A->evalWithGrad(x), b = B->evalWithGrad(x);
+    return ValueAndGrad<real>(a.value.dot(b.value), a.grad.transpose()*b.value + b.grad.transpose()*a.value);
+  }
 };
 inline ScalarField dot(VectorField a, VectorField b)
 { return ScalarField(new InnerProductField(a.node,b.node)); }
@@ -45,15 +179,82 @@ struct WarpField : public ConstructFieldNode<T> {
   VFNodePtr g;
   WarpField(typename ConstructFieldNode<T>::ptr f, VFNodePtr g) : f(f), g(g) { }
   T eval(const Vec3& x) const { return f->eval(g->eval(x)); }
+  void evalBlock(const Vec3* xs, T* out, size_t n) const {
+    Vec3 ys[BlockSize];
+    g->evalBlock(xs, ys, n);
+    f->evalBlock(ys, out, n);
+  }
+  //! Warping needs no instruction: f is lowered at the points g produces
+  int compile(FieldCompiler& c, int x) const
+  { return c.lower(*f, c.lower(*g, x)); }
+  int compileGrad(FieldCompiler& c, int x) const;
+  void shape(FieldShape& s) const
+  { s(f); s(g); }
+  typename ConstructFieldNode<T>::ptr simplify(FieldSimplifier& s) const;
   typename FieldInfo<T>::GradType grad(const Vec3& x) const { 
 		throw std::logic_error("Can not take gradients of matrix fields in the Construct."); 
 		return FieldInfo<typename FieldInfo<T>::GradType>::Zero();
 	}
+  ValueAndGrad<T> evalWithGrad(const Vec3& x) const {
+		throw std::logic_error("Can not take gradients of matrix fields in the Construct.");
+		return ValueAndGrad<T>(FieldInfo<T>::Zero(), FieldInfo<typename FieldInfo<T>::GradType>::Zero());
+	}
 };
+template<> ValueAndGrad<real> WarpField<real>::evalWithGrad(const Vec3& x) const {
+  const ValueAndGrad<Vec3> gx = g->evalWithGrad(x);
+  const ValueAndGrad<real> fg = f->evalWithGrad(gx.value);
+  return ValueAndGrad<real>(fg.value, gx.grad * fg.grad);
+}
+template<> ValueAndGrad<Vec3> WarpField<Vec3>::evalWithGrad(const Vec3& x) const {
+  const ValueAndGrad<Vec3> gx = g->evalWithGrad(x);
+  const ValueAndGrad<Vec3> fg = f->evalWithGrad(gx.value);
+  return ValueAndGrad<Vec3>(fg.value, gx.grad * fg.grad);
+}
 template<> Vec3 WarpField<real>::grad(const Vec3& x) const
-{ return g->grad(x) * f->grad(g->eval(x)); }
+{ return evalWithGrad(x).grad; }
 template<> Mat3 WarpField<Vec3>::grad(const Vec3& x) const
-{ return g->grad(x) * f->grad(g->eval(x)); }
+{ return evalWithGrad(x).grad; }
+
+template<typename T>
+int WarpField<T>::compileGrad(FieldCompiler& c, int x) const
+{ return c.callGrad(this, x); }
+template<> int WarpField<real>::compileGrad(FieldCompiler& c, int x) const {
+  const int gg = c.lowerGrad(*g, x);
+  return c.emit<Vec3>(OpMulMV, gg, c.lowerGrad(*f, c.lower(*g, x)));
+}
+template<> int WarpField<Vec3>::compileGrad(FieldCompiler& c, int x) const {
+  const int gg = c.lowerGrad(*g, x);
+  return c.emit<Mat3>(OpMulMM, gg, c.lowerGrad(*f, c.lower(*g, x)));
+}
+
+//! f(A*x + b) as a single warp, composing affine warps inside f into
+//! the same map
+template<typename T>
+inline typename ConstructFieldNode<T>::ptr collapseAffineWarp(
+  const typename ConstructFieldNode<T>::ptr& f, const Mat3& A, const Vec3& b) {
+  if(A == Mat3::Identity() && b == Vec3::Zero()) return f;
+  Mat3 Ai;
+  Vec3 bi;
+  const WarpField<T>* inner = dynamic_cast<const WarpField<T>*>(f.get());
+  if(inner && asAffine(inner->g, Ai, bi)) return collapseAffineWarp<T>(inner->f, Ai*A, Ai*b + bi);
+  return adopt(new WarpField<T>(f, affine(A, b)));
+}
+
+template<typename T>
+typename ConstructFieldNode<T>::ptr WarpField<T>::simplify(FieldSimplifier& s) const {
+  typedef typename ConstructFieldNode<T>::ptr Ptr;
+  const Ptr sf = s(f);
+  const VFNodePtr sg = s(g);
+  if(s.constant(sf)) return sf;
+  Mat3 A, Ai;
+  Vec3 b, bi;
+  if(asAffine(sg, A, b)) {
+    const WarpField<T>* inner = dynamic_cast<const WarpField<T>*>(sf.get());
+    if((A == Mat3::Identity() && b == Vec3::Zero()) || (inner && asAffine(inner->g, Ai, bi)))
+      return collapseAffineWarp<T>(sf, A, b);
+  }
+  return sf == f && sg == g ? Ptr() : adopt(new WarpField<T>(sf, sg));
+}
 
 template<typename T>
 inline Field<T> warp(Field<T> f, VectorField v)
@@ -64,13 +265,46 @@ struct CrossProductField : public VectorFieldNode {
   VFNodePtr f,g;
   CrossProductField(VFNodePtr f, VFNodePtr g) : f(f), g(g) { }
   Vec3 eval(const Vec3& x) const { return f->eval(x).cross(g->eval(x)); }
-  Mat3 grad(const Vec3& x) const {
-    Mat3 df = f->grad(x), dg = g->grad(x), result;
-    Vec3 fx = f->eval(x), gx = g->eval(x);
+  void evalBlock(const Vec3* xs, Vec3* out, size_t n) const {
+    Vec3 gx[BlockSize];
+    SoABlock sf, sg, result;
+    f->evalBlock(xs, out, n);
+    g->evalBlock(xs, gx, n);
+    sf.load(out, n);
+    sg.load(gx, n);
+    simd::cross(sf, sg, result, n);
+    result.store(out, n);
+  }
+  int compile(FieldCompiler& c, int x) const {
+    const int a = c.lower(*f, x), b = c.lower(*g, x);
+    return c.emit<Vec3>(OpCross, a, b);
+  }
+  //! d(f x g) = [f]x dg - [g]x df, as in grad() below
+  int compileGrad(FieldCompiler& c, int x) const {
+    const int fx = c.lower(*f, x), gx = c.lower(*g, x);
+    const int df = c.lowerGrad(*f, x), dg = c.lowerGrad(*g, x);
+    return c.emit<Mat3>(OpSubM,
+      c.emit<Mat3>(OpMulMM, c.emit<Mat3>(OpSkew, fx), dg),
+      c.emit<Mat3>(OpMulMM, c.emit<Mat3>(OpSkew, gx), df));
+  }
+  void shape(FieldShape& s) const
+  { s(f); s(g); }
+  VFNodePtr simplify(FieldSimplifier& s) const {
+    const VFNodePtr a = s(f), b = s(g);
+    if(s.constant(a) && s.constant(b)) return s.fold<Vec3>(new CrossProductField(a, b));
+    if(s.zero(a) || s.zero(b)) return adopt(new ConstantField<Vec3>(Vec3::Zero()));
+    return a == f && b == g ? VFNodePtr() : adopt(new CrossProductField(a, b));
+  }
+  Mat3 grad(const Vec3& x) const { return evalWithGrad(x).grad; }
+  ValueAndGrad<Vec3> evalWithGrad(const Vec3& x) const {
+    const ValueAndGrad<Vec3> fv = f->evalWithGrad(x), gv = g->evalWithGrad(x);
+    const Mat3 &df = fv.grad, &dg = gv.grad;
+    const Vec3 &fx = fv.value, &gx = gv.value;
+    Mat3 result;
     result.row(0) = gx.z()*df.row(1) + fx.y()*dg.row(2) - fx.z()*dg.row(1) - gx.y()*df.row(2);
     result.row(1) = gx.x()*df.row(2) + fx.z()*dg.row(0) - fx.x()*dg.row(2) - gx.z()*df.row(0);
     result.row(2) = gx.y()*df.row(0) + fx.x()*dg.row(1) - fx.y()*dg.row(0) - gx.x()*df.row(1);
-    return result;
+    return ValueAndGrad<Vec3>(fx.cross(gx), result);
   }
 };
 inline VectorField cross(VectorField f, VectorField g)
@@ -81,6 +315,23 @@ struct OuterProductField : public MatrixFieldNode {
   VFNodePtr f, g;
   OuterProductField(VFNodePtr f, VFNodePtr g) : f(f), g(g) { }
   Mat3 eval(const Vec3& x) const { return f->eval(x) * g->eval(x).transpose(); }
+  void evalBlock(const Vec3* xs, Mat3* out, size_t n) const {
+    Vec3 fx[BlockSize], gx[BlockSize];
+    f->evalBlock(xs, fx, n);
+    g->evalBlock(xs, gx, n);
+    for(size_t i=0;i<n;++i) out[i] = fx[i] * gx[i].transpose();
+  }
+  int compile(FieldCompiler& c, int x) const {
+    const int a = c.lower(*f, x), b = c.lower(*g, x);
+    return c.emit<Mat3>(OpOuter, a, b);
+  }
+  void shape(FieldShape& s) const
+  { s(f); s(g); }
+  MFNodePtr simplify(FieldSimplifier& s) const {
+    const VFNodePtr a = s(f), b = s(g);
+    if(s.constant(a) && s.constant(b)) return s.fold<Mat3>(new OuterProductField(a, b));
+    return a == f && b == g ? MFNodePtr() : adopt(new OuterProductField(a, b));
+  }
   // No grad(MatrixField) allowed
 };
 inline MatrixField outer_product(VectorField f, VectorField g)
@@ -99,6 +350,27 @@ struct LinearSolveField : public VectorFieldNode {
 		if(lu.rank() < 3) return Vec3(0,0,0);
 		return lu.solve(v);
 	}
+	void evalBlock(const Vec3* xs, Vec3* out, size_t n) const {
+		Mat3 m[BlockSize];
+		matrix->evalBlock(xs, m, n);
+		vector->evalBlock(xs, out, n);
+		for(size_t i=0;i<n;++i) {
+			Eigen::FullPivLU<Mat3> lu(m[i]);
+			out[i] = lu.rank() < 3 ? Vec3(0,0,0) : Vec3(lu.solve(out[i]));
+		}
+	}
+	int compile(FieldCompiler& c, int x) const {
+		const int a = c.lower(*matrix, x), b = c.lower(*vector, x);
+		return c.emit<Vec3>(OpSolve, a, b);
+	}
+	void shape(FieldShape& s) const
+	{ s(matrix); s(vector); }
+	VFNodePtr simplify(FieldSimplifier& s) const {
+		const MFNodePtr m = s(matrix);
+		const VFNodePtr v = s(vector);
+		if(s.constant(m) && s.constant(v)) return s.fold<Vec3>(new LinearSolveField(m, v));
+		return m == matrix && v == vector ? VFNodePtr() : adopt(new LinearSolveField(m, v));
+	}
 	Mat3 grad(const Vec3& x) const { 
 		throw std::logic_error("Can not take gradients of matrix fields in the Construct."); 
 		return Mat3::Zero();
@@ -112,6 +384,19 @@ struct TransposeField : public MatrixFieldNode {
 	MFNodePtr m;
 	TransposeField(MFNodePtr m) : m(m) { }
 	Mat3 eval(const Vec3& x) const { return m->eval(x).transpose(); }
+	void evalBlock(const Vec3* xs, Mat3* out, size_t n) const {
+		m->evalBlock(xs, out, n);
+		for(size_t i=0;i<n;++i) out[i].transposeInPlace();
+	}
+	int compile(FieldCompiler& c, int x) const
+	{ return c.emit<Mat3>(OpTranspose, c.lower(*m, x)); }
+	void shape(FieldShape& s) const
+	{ s(m); }
+	MFNodePtr simplify(FieldSimplifier& s) const {
+		const MFNodePtr sm = s(m);
+		if(s.constant(sm)) return s.fold<Mat3>(new TransposeField(sm));
+		return sm == m ? MFNodePtr() : adopt(new TransposeField(sm));
+	}
 	Mat3 grad(const Vec3& x) const { 
 		throw std::logic_error("Can not take gradients of matrix fields in the Construct."); 
 		return Mat3::Zero();
@@ -1,6 +1,8 @@
 #ifndef ConstructArithmetic_h
 #define ConstructArithmetic_h
 #include "construct/ConstructField.h"
+#include "construct/ConstructAlgebra.h"
+#include "construct/ConstructSIMD.h"
 namespace Construct {
 
 // Addition
@@ -11,8 +13,37 @@ struct AdditionField : public ConstructFieldNode<T> {
  AdditionField(Ptr A, Ptr B) : A(A), B(B) { }
  T eval(const Vec3& x) const 
  { return A->eval(x) + B->eval(x); }
+ void evalBlock(const Vec3* xs, T* out, size_t n) const {
+   T b[BlockSize];
+   A->evalBlock(xs, out, n);
+   B->evalBlock(xs, b, n);
+   simd::add(Scalars<T>::ptr(out), Scalars<T>::ptr(b), Scalars<T>::ptr(out), n * Scalars<T>::Count);
+ }
+ int compile(FieldCompiler& c, int x) const {
+   const int a = c.lower(*A, x), b = c.lower(*B, x);
+   return c.emit<T>(Register<T>::Add, a, b);
+ }
+ int compileGrad(FieldCompiler& c, int x) const {
+   typedef typename FieldInfo<T>::GradType GradType;
+   const int a = c.lowerGrad(*A, x), b = c.lowerGrad(*B, x);
+   return c.emit<GradType>(Register<GradType>::Add, a, b);
+ }
+ void shape(FieldShape& s) const
+ { s(A); s(B); }
+ Ptr simplify(FieldSimplifier& s) const {
+   const Ptr a = s(A), b = s(B);
+   if(s.constant(a) && s.constant(b)) return s.fold<T>(new AdditionField<T>(a, b));
+   if(s.zero(b)) return a;
+   if(s.zero(a)) return b;
+   if(const Ptr affine = affineCombination<T>(a, 1, b, 1)) return affine;
+   return a == A && b == B ? Ptr() : adopt(new AdditionField<T>(a, b));
+ }
  typename FieldInfo<T>::GradType grad(const Vec3& x) const
- { return A->grad(x) + B->grad(x); }
+ { return evalWithGrad(x).grad; }
+ ValueAndGrad<T> evalWithGrad(const Vec3& x) const {
+   const ValueAndGrad<T> a = A->evalWithGrad(x), b = B->evalWithGrad(x);
+   return ValueAndGrad<T>(a.value + b.value, a.grad + b.grad);
+ }
 };
 template<typename T>
 Field<T> operator+(Field<T> A, Field<T> B)
@@ -26,13 +57,58 @@ struct SubtractionField : public ConstructFieldNode<T> {
  SubtractionField(Ptr A, Ptr B) : A(A), B(B) { }
  T eval(const Vec3& x) const 
  { return A->eval(x) - B->eval(x); }
+ void evalBlock(const Vec3* xs, T* out, size_t n) const {
+   T b[BlockSize];
+   A->evalBlock(xs, out, n);
+   B->evalBlock(xs, b, n);
+   simd::sub(Scalars<T>::ptr(out), Scalars<T>::ptr(b), Scalars<T>::ptr(out), n * Scalars<T>::Count);
+ }
+ int compile(FieldCompiler& c, int x) const {
+   const int a = c.lower(*A, x), b = c.lower(*B, x);
+   return c.emit<T>(Register<T>::Sub, a, b);
+ }
+ int compileGrad(FieldCompiler& c, int x) const {
+   typedef typename FieldInfo<T>::GradType GradType;
+   const int a = c.lowerGrad(*A, x), b = c.lowerGrad(*B, x);
+   return c.emit<GradType>(Register<GradType>::Sub, a, b);
+ }
+ void shape(FieldShape& s) const
+ { s(A); s(B); }
+ Ptr simplify(FieldSimplifier& s) const {
+   const Ptr a = s(A), b = s(B);
+   if(s.constant(a) && s.constant(b)) return s.fold<T>(new SubtractionField<T>(a, b));
+   if(s.zero(b)) return a;
+   if(const Ptr affine = affineCombination<T>(a, 1, b, -1)) return affine;
+   return a == A && b == B ? Ptr() : adopt(new SubtractionField<T>(a, b));
+ }
  typename FieldInfo<T>::GradType grad(const Vec3& x) const
- { return A->grad(x) - B->grad(x); }
+ { return evalWithGrad(x).grad; }
+ ValueAndGrad<T> evalWithGrad(const Vec3& x) const {
+   const ValueAndGrad<T> a = A->evalWithGrad(x), b = B->evalWithGrad(x);
+   return ValueAndGrad<T>(a.value - b.value, a.grad - b.grad);
+ }
 };
 template<typename T>
 Field<T> operator-(Field<T> A, Field<T> B)
 { return Field<T>(new SubtractionField<T>(A.node,B.node)); }
 
+//! A node of type From passed on as a node of type To, when those agree
+template<typename From, typename To> struct SameNode {
+  static typename ConstructFieldNode<To>::ptr cast(const typename ConstructFieldNode<From>::ptr& p)
+  { return typename ConstructFieldNode<To>::ptr(); }
+};
+template<typename T> struct SameNode<T,T> {
+  static typename ConstructFieldNode<T>::ptr cast(const typename ConstructFieldNode<T>::ptr& p)
+  { return p; }
+};
+
+//! Type specific rewrites of a product of simplified factors (see below)
+template<typename LeftType, typename RightType, typename ResultType> struct ProductRewrite {
+  static typename ConstructFieldNode<ResultType>::ptr apply(
+    const typename ConstructFieldNode<LeftType>::ptr& a, const typename ConstructFieldNode<RightType>::ptr& b)
+  { return typename ConstructFieldNode<ResultType>::ptr(); }
+};
+
 // Multiplication
 template<typename LeftType, typename RightType, typename ResultType>
 struct MultiplicationField : public ConstructFieldNode<ResultType> {
@@ -43,23 +119,126 @@ struct MultiplicationField : public ConstructFieldNode<ResultType> {
     typename ConstructFieldNode<RightType>::ptr B) : A(A), B(B) { }
   ResultType eval(const Vec3& x) const
   { return A->eval(x) * B->eval(x); }
+  void evalBlock(const Vec3* xs, ResultType* out, size_t n) const {
+    LeftType a[BlockSize];
+    RightType b[BlockSize];
+    A->evalBlock(xs, a, n);
+    B->evalBlock(xs, b, n);
+    for(size_t i=0;i<n;++i) out[i] = a[i] * b[i];
+  }
+  int compile(FieldCompiler& c, int x) const {
+    const int a = c.lower(*A, x), b = c.lower(*B, x);
+    return c.emit<ResultType>(MulOp<LeftType,RightType>::Code, a, b);
+  }
+  int compileGrad(FieldCompiler& c, int x) const;
+  void shape(FieldShape& s) const
+  { s(A); s(B); }
+  typename ConstructFieldNode<ResultType>::ptr simplify(FieldSimplifier& s) const {
+    typedef typename ConstructFieldNode<ResultType>::ptr Ptr;
+    const typename ConstructFieldNode<LeftType>::ptr a = s(A);
+    const typename ConstructFieldNode<RightType>::ptr b = s(B);
+    if(s.constant(a) && s.constant(b)) return s.fold<ResultType>(new MultiplicationField(a, b));
+    if(s.zero(a) || s.zero(b)) return adopt(new ConstantField<ResultType>(FieldInfo<ResultType>::Zero()));
+    if(s.one(b)) if(const Ptr p = SameNode<LeftType,ResultType>::cast(a)) return p;
+    if(s.one(a)) if(const Ptr p = SameNode<RightType,ResultType>::cast(b)) return p;
+    if(const Ptr p = ProductRewrite<LeftType,RightType,ResultType>::apply(a, b)) return p;
+    return a == A && b == B ? Ptr() : adopt(new MultiplicationField(a, b));
+  }
   typename FieldInfo<ResultType>::GradType grad(const Vec3& x) const
-  { return A->grad(x) * B->eval(x) + A->eval(x) * B->grad(x); }
+  { return evalWithGrad(x).grad; }
+  ValueAndGrad<ResultType> evalWithGrad(const Vec3& x) const {
+    const ValueAndGrad<LeftType> a = A->evalWithGrad(x);
+    const ValueAndGrad<RightType> b = B->evalWithGrad(x);
+    return ValueAndGrad<ResultType>(a.value * b.value, a.grad * b.value + a.value * b.grad);
+  }
 };
+// SIMD kernels for the common scalar products
+template<> void MultiplicationField<real,real,real>::evalBlock(const Vec3* xs, real* out, size_t n) const {
+  real b[BlockSize];
+  A->evalBlock(xs, out, n);
+  B->evalBlock(xs, b, n);
+  simd::mul(out, b, out, n);
+}
+template<> void MultiplicationField<Vec3,real,Vec3>::evalBlock(const Vec3* xs, Vec3* out, size_t n) const {
+  real b[BlockSize];
+  A->evalBlock(xs, out, n);
+  B->evalBlock(xs, b, n);
+  simd::scale3(Scalars<Vec3>::ptr(out), b, Scalars<Vec3>::ptr(out), n);
+}
+
+// Product rule, sharing the factor values with the product itself
+template<typename LeftType, typename RightType, typename ResultType>
+int MultiplicationField<LeftType,RightType,ResultType>::compileGrad(FieldCompiler& c, int x) const
+{ return c.callGrad(this, x); }
+template<> int MultiplicationField<real,real,real>::compileGrad(FieldCompiler& c, int x) const {
+  const int a = c.lower(*A, x), b = c.lower(*B, x);
+  const int ga = c.lowerGrad(*A, x), gb = c.lowerGrad(*B, x);
+  return c.emit<Vec3>(OpAddV, c.emit<Vec3>(OpMulVR, ga, b), c.emit<Vec3>(OpMulVR, gb, a));
+}
+template<> int MultiplicationField<Vec3,real,Vec3>::compileGrad(FieldCompiler& c, int x) const {
+  const int a = c.lower(*A, x), b = c.lower(*B, x);
+  const int ga = c.lowerGrad(*A, x), gb = c.lowerGrad(*B, x);
+  return c.emit<Mat3>(OpAddM, c.emit<Mat3>(OpMulMR, ga, b), c.emit<Mat3>(OpOuter, a, gb));
+}
+
 // grad( Vector * Real )
-template<> Mat3 MultiplicationField<Vec3,real,Vec3>::grad(const Vec3& x) const
-{ return A->grad(x) * B->eval(x) + A->eval(x) * B->grad(x).transpose(); }
+template<> ValueAndGrad<Vec3> MultiplicationField<Vec3,real,Vec3>::evalWithGrad(const Vec3& x) const {
+  const ValueAndGrad<Vec3> a = A->evalWithGrad(x);
+  const ValueAndGrad<real> b = B->evalWithGrad(x);
+  return ValueAndGrad<Vec3>(a.value * b.value, a.grad * b.value + a.value * b.grad.transpose());
+}
 
 // Disallow gradients of those operations on matrix fields
-template<> Mat3 MultiplicationField<Mat3,Vec3,Vec3>::grad(const Vec3& x) const
+template<> ValueAndGrad<Vec3> MultiplicationField<Mat3,Vec3,Vec3>::evalWithGrad(const Vec3& x) const
 { throw std::logic_error("Can not take gradients of matrix fields in the Construct."); }
-template<> Mat3 MultiplicationField<Mat3,Mat3,Mat3>::grad(const Vec3& x) const
+template<> ValueAndGrad<Mat3> MultiplicationField<Mat3,Mat3,Mat3>::evalWithGrad(const Vec3& x) const
 { throw std::logic_error("Can not take gradients of matrix fields in the Construct."); }
-template<> Mat3 MultiplicationField<Mat3,real,Mat3>::grad(const Vec3& x) const
+template<> ValueAndGrad<Mat3> MultiplicationField<Mat3,real,Mat3>::evalWithGrad(const Vec3& x) const
 { throw std::logic_error("Can not take gradients of matrix fields in the Construct."); }
-template<> Mat3 MultiplicationField<real,Mat3,Mat3>::grad(const Vec3& x) const
+template<> ValueAndGrad<Mat3> MultiplicationField<real,Mat3,Mat3>::evalWithGrad(const Vec3& x) const
 { throw std::logic_error("Can not take gradients of matrix fields in the Construct."); }
 
+//! Splits c*f or f*c, for a constant c, into c and f
+inline bool constantFactor(const SFNodePtr& p, real& c, SFNodePtr& rest) {
+  const MultiplicationField<real,real,real>* m = dynamic_cast<const MultiplicationField<real,real,real>*>(p.get());
+  if(!m) return false;
+  if(const ConstantField<real>* k = FieldSimplifier::constant(m->A)) { c = k->value; rest = m->B; return true; }
+  if(const ConstantField<real>* k = FieldSimplifier::constant(m->B)) { c = k->value; rest = m->A; return true; }
+  return false;
+}
+
+// c1 * (c2 * f) -> (c1*c2) * f
+template<> struct ProductRewrite<real,real,real> {
+  static SFNodePtr apply(const SFNodePtr& a, const SFNodePtr& b) {
+    real c;
+    SFNodePtr f;
+    if(const ConstantField<real>* k = FieldSimplifier::constant(a))
+      if(constantFactor(b, c, f)) return adopt(new MultiplicationField<real,real,real>(adopt(new ConstantField<real>(k->value * c)), f));
+    if(const ConstantField<real>* k = FieldSimplifier::constant(b))
+      if(constantFactor(a, c, f)) return adopt(new MultiplicationField<real,real,real>(f, adopt(new ConstantField<real>(c * k->value))));
+    return SFNodePtr();
+  }
+};
+// Scaled affine maps, and v * (c * f) -> (c*v) * f for constant v and c
+template<> struct ProductRewrite<Vec3,real,Vec3> {
+  static VFNodePtr apply(const VFNodePtr& a, const SFNodePtr& b) {
+    if(const ConstantField<real>* k = FieldSimplifier::constant(b))
+      return affineProduct<Vec3>(k->value * Mat3::Identity(), a);
+    real c;
+    SFNodePtr f;
+    if(const ConstantField<Vec3>* v = FieldSimplifier::constant(a))
+      if(constantFactor(b, c, f)) return adopt(new MultiplicationField<Vec3,real,Vec3>(adopt(new ConstantField<Vec3>(v->value * c)), f));
+    return VFNodePtr();
+  }
+};
+// Constant matrices applied to affine maps
+template<> struct ProductRewrite<Mat3,Vec3,Vec3> {
+  static VFNodePtr apply(const MFNodePtr& a, const VFNodePtr& b) {
+    const ConstantField<Mat3>* m = FieldSimplifier::constant(a);
+    return m ? affineProduct<Vec3>(m->value, b) : VFNodePtr();
+  }
+};
+
 ScalarField operator*(ScalarField a, ScalarField b)
 { return ScalarField(new MultiplicationField<real,real,real>(a.node, b.node)); }
 VectorField operator*(VectorField v, ScalarField s)
@@ -86,20 +265,78 @@ struct DivisionField : public ConstructFieldNode<T> {
   : A(A), B(divisor) { }
   T eval(const Vec3& x) const
   { return A->eval(x) / B->eval(x); }
+  void evalBlock(const Vec3* xs, T* out, size_t n) const {
+    real b[BlockSize];
+    A->evalBlock(xs, out, n);
+    B->evalBlock(xs, b, n);
+    for(size_t i=0;i<n;++i) out[i] /= b[i];
+  }
+  int compile(FieldCompiler& c, int x) const {
+    const int a = c.lower(*A, x), b = c.lower(*B, x);
+    return c.emit<T>(Register<T>::Div, a, b);
+  }
+  int compileGrad(FieldCompiler& c, int x) const;
+  void shape(FieldShape& s) const
+  { s(A); s(B); }
+  typename ConstructFieldNode<T>::ptr simplify(FieldSimplifier& s) const {
+    typedef typename ConstructFieldNode<T>::ptr Ptr;
+    const Ptr a = s(A);
+    const SFNodePtr b = s(B);
+    if(s.constant(a) && s.constant(b)) return s.fold<T>(new DivisionField<T>(a, b));
+    if(s.one(b)) return a;
+    if(s.zero(a)) return a;
+    if(const ConstantField<real>* k = s.constant(b))
+      if(const Ptr p = affineProduct<T>(Mat3::Identity() / k->value, a)) return p;
+    return a == A && b == B ? Ptr() : adopt(new DivisionField<T>(a, b));
+  }
   typename FieldInfo<T>::GradType grad(const Vec3& x) const
-  { 
-    real div = B->eval(x);
-    return (A->grad(x)*div - A->eval(x) * B->grad(x)) / (div*div);
+  { return evalWithGrad(x).grad; }
+  ValueAndGrad<T> evalWithGrad(const Vec3& x) const {
+    const ValueAndGrad<T> a = A->evalWithGrad(x);
+    const ValueAndGrad<real> b = B->evalWithGrad(x);
+    const real div = b.value;
+    return ValueAndGrad<T>(a.value / div, (a.grad*div - a.value * b.grad) / (div*div));
   }
 };
 
+template<> void DivisionField<real>::evalBlock(const Vec3* xs, real* out, size_t n) const {
+  real b[BlockSize];
+  A->evalBlock(xs, out, n);
+  B->evalBlock(xs, b, n);
+  simd::div(out, b, out, n);
+}
+template<> void DivisionField<Vec3>::evalBlock(const Vec3* xs, Vec3* out, size_t n) const {
+  real b[BlockSize];
+  A->evalBlock(xs, out, n);
+  B->evalBlock(xs, b, n);
+  simd::reciprocal(b, b, n);
+  simd::scale3(Scalars<Vec3>::ptr(out), b, Scalars<Vec3>::ptr(out), n);
+}
+
+template<typename T>
+int DivisionField<T>::compileGrad(FieldCompiler& c, int x) const
+{ return c.callGrad(this, x); }
+template<> int DivisionField<real>::compileGrad(FieldCompiler& c, int x) const {
+  const int a = c.lower(*A, x), b = c.lower(*B, x);
+  const int ga = c.lowerGrad(*A, x), gb = c.lowerGrad(*B, x);
+  const int num = c.emit<Vec3>(OpSubV, c.emit<Vec3>(OpMulVR, ga, b), c.emit<Vec3>(OpMulVR, gb, a));
+  return c.emit<Vec3>(OpDivV, num, c.emit<real>(OpMulRR, b, b));
+}
+template<> int DivisionField<Vec3>::compileGrad(FieldCompiler& c, int x) const {
+  const int a = c.lower(*A, x), b = c.lower(*B, x);
+  const int ga = c.lowerGrad(*A, x), gb = c.lowerGrad(*B, x);
+  const int num = c.emit<Mat3>(OpSubM, c.emit<Mat3>(OpMulMR, ga, b), c.emit<Mat3>(OpOuter, a, gb));
+  return c.emit<Mat3>(OpDivM, num, c.emit<real>(OpMulRR, b, b));
+}
+
 // TODO: Check to see if AB' should be transposed!
-template<> Mat3 DivisionField<Vec3>::grad(const Vec3& x) const
-{
-    real div = B->eval(x);
-    return (A->grad(x)*div - A->eval(x) * B->grad(x).transpose()) / (div*div);
+template<> ValueAndGrad<Vec3> DivisionField<Vec3>::evalWithGrad(const Vec3& x) const {
+    const ValueAndGrad<Vec3> a = A->evalWithGrad(x);
+    const ValueAndGrad<real> b = B->evalWithGrad(x);
+    const real div = b.value;
+    return ValueAndGrad<Vec3>(a.value / div, (a.grad*div - a.value * b.grad.transpose()) / (div*div));
 }
-template<> Mat3 DivisionField<Mat3>::grad(const Vec3& x) const
+template<> ValueAndGrad<Mat3> DivisionField<Mat3>::evalWithGrad(const Vec3& x) const
 { throw std::logic_error("Can not take gradients of matrix fields in the Construct."); }
 
 template<typename T>
@@ -11,6 +11,10 @@ namespace Construct {
   // Linear Algebra types
   typedef Eigen::Matrix<real, 3, 1> Vec3;
   typedef Eigen::Matrix<real, 3, 3> Mat3;
+
+  //! Largest number of points handed to a single evalBlock call.
+  //! Nodes keep their per-block scratch on the stack at this size.
+  enum { BlockSize = 64 };
 };
 
 #endif
@@ -2,8 +2,38 @@
 #define ConstructCalculus_h
 #include "construct/ConstructAlgebra.h"
 #include "construct/ConstructArithmetic.h"
+#include <cmath>
+#include <limits>
+#include <algorithm>
 namespace Construct {
 
+//! Step to difference exact first derivatives at x: the cube root of
+//! epsilon relative to the size of x, which balances truncation against
+//! rounding at any distance from the origin, and no less than spacing,
+//! the finest lattice spacing sampled (0 for none), so that differences
+//! of gridded gradients span cells rather than straddle a face.
+inline real differenceStep(const Vec3& x, real spacing) {
+	const real h = std::cbrt(std::numeric_limits<real>::epsilon()) * std::max(static_cast<real>(1), x.cwiseAbs().maxCoeff());
+	return std::max(h, spacing);
+}
+
+inline void setDerivative(Vec3& D, int j, real d) { D[j] = d; }
+inline void setDerivative(Mat3& D, int j, const Vec3& d) { D.row(j) = d.transpose(); }
+
+//! Central differences of f at x, where f gives exact values (first
+//! derivatives, computed in forward mode) so the result is second order
+//! accurate. Entry, or row, j is the derivative along x_j, as for grids.
+template<typename D, typename F>
+inline D centralDifference(const F& f, const Vec3& x, real spacing) {
+	const real h = differenceStep(x, spacing);
+	D result;
+	for(int j=0;j<3;++j) {
+		Vec3 e(0,0,0); e[j] = h;
+		setDerivative(result, j, (f(x+e) - f(x-e)) / (2*h));
+	}
+	return result;
+}
+
 //! Gradient Operator
 template<typename T>
 struct GradField : public ConstructFieldNode<typename FieldInfo<T>::GradType> {
@@ -11,14 +41,28 @@ struct GradField : public ConstructFieldNode<typename FieldInfo<T>::GradType> {
 	typedef typename FieldInfo<T>::GradType GradType;
 	typedef typename FieldInfo<GradType>::GradType GradType2;
 	Ptr f;
-	GradField(Ptr f) : f(f) { }
-	GradType eval(const Vec3& x) const { return f->grad(x); }
+	real lattice; //! Finest grid spacing under f
+	GradField(Ptr f) : f(f), lattice(latticeSpacing(*f)) { }
+	GradType eval(const Vec3& x) const { return f->evalWithGrad(x).grad; }
+	void evalBlock(const Vec3* xs, GradType* out, size_t n) const
+	{ for(size_t i=0;i<n;++i) out[i] = f->evalWithGrad(xs[i]).grad; }
+	int compile(FieldCompiler& c, int x) const
+	{ return c.lowerGrad(*f, x); }
+	void shape(FieldShape& s) const
+	{ s(f); }
+	typename ConstructFieldNode<GradType>::ptr simplify(FieldSimplifier& s) const {
+		const Ptr sf = s(f);
+		return sf == f ? typename ConstructFieldNode<GradType>::ptr() : adopt(new GradField<T>(sf));
+	}
 	GradType2 grad(const Vec3& x) const
 	{ 
 		throw std::logic_error("Can not analytically create second derivatives..."); 
 		return FieldInfo<GradType2>::Zero(); 
 	}
 };
+//! Hessian of a scalar field, by differencing its exact gradient
+template<> inline Mat3 GradField<real>::grad(const Vec3& x) const
+{ return centralDifference<Mat3>([this](const Vec3& y) { return eval(y); }, x, lattice); }
 template<typename T>
 inline Field<typename FieldInfo<T>::GradType> grad(Field<T> field)
 { return new GradField<T>(field.node ); }
@@ -50,6 +94,46 @@ struct LineIntegralField : public ConstructFieldNode<T> {
 		return integral;
 	}
 
+	//! Marches all n paths in lockstep, evaluating the child fields only
+	//! over the paths which have not yet travelled their full distance.
+	void evalBlock(const Vec3* xs, T* out, size_t n) const {
+		real target_distance[BlockSize], step[BlockSize];
+		Vec3 p[BlockSize], points[BlockSize], dx[BlockSize];
+		T integrand[BlockSize];
+		size_t active[BlockSize];
+		distance->evalBlock(xs, target_distance, n);
+		start->evalBlock(xs, p, n);
+		for(size_t i=0;i<n;++i) { out[i] = FieldInfo<T>::Zero(); active[i] = i; }
+
+		size_t m = n;
+		while(m > 0) {
+			// Gather the points of the paths still being integrated
+			for(size_t a=0;a<m;++a) points[a] = p[active[a]];
+			step_size->evalBlock(points, step, m);
+			field->evalBlock(points, integrand, m);
+			flow->evalBlock(points, dx, m);
+
+			size_t remaining = 0;
+			for(size_t a=0;a<m;++a) {
+				const size_t i = active[a];
+				out[i] += integrand[a] * step[a];
+				p[i] += dx[a] * step[a];
+				target_distance[i] -= step[a];
+				if(target_distance[i] >= static_cast<real>(0))
+					active[remaining++] = i;
+			}
+			m = remaining;
+		}
+	}
+
+	Ptr simplify(FieldSimplifier& s) const {
+		const Ptr sfield = s(field);
+		const VFNodePtr sstart = s(start), sflow = s(flow);
+		const SFNodePtr sdistance = s(distance), sstep = s(step_size);
+		if(sfield == field && sstart == start && sflow == flow && sdistance == distance && sstep == step_size) return Ptr();
+		return adopt(new LineIntegralField<T>(sfield, sstart, sflow, sdistance, sstep));
+	}
+
 	// TODO: Compute grad(lineIntegral) !
 	typename FieldInfo<T>::GradType grad(const Vec3& x) const
 	{ return FieldInfo<typename FieldInfo<T>::GradType>::Zero(); }
@@ -61,13 +145,25 @@ inline Field<T> lineIntegral(Field<T> field, VectorField start, VectorField flow
 //! Divergence Operator
 struct DivergenceField : public ScalarFieldNode {
 	VFNodePtr field;
-	DivergenceField(VFNodePtr field) : field(field) { }
+	real lattice; //! Finest grid spacing under field
+	DivergenceField(VFNodePtr field) : field(field), lattice(latticeSpacing(*field)) { }
 	real eval(const Vec3& x) const {
-		Mat3 G = field->grad(x);
+		Mat3 G = field->evalWithGrad(x).grad;
 		return G.trace();
 	}
+	void evalBlock(const Vec3* xs, real* out, size_t n) const
+	{ for(size_t i=0;i<n;++i) out[i] = field->evalWithGrad(xs[i]).grad.trace(); }
+	int compile(FieldCompiler& c, int x) const
+	{ return c.emit<real>(OpTrace, c.lowerGrad(*field, x)); }
+	void shape(FieldShape& s) const
+	{ s(field); }
+	SFNodePtr simplify(FieldSimplifier& s) const {
+		const VFNodePtr sfield = s(field);
+		return sfield == field ? SFNodePtr() : adopt(new DivergenceField(sfield));
+	}
+	//! Differenced from the exact gradient of the field
 	Vec3 grad(const Vec3& x) const 
-	{	throw std::logic_error("Can not analytically create second derivatives..."); return Vec3(0,0,0); }
+	{ return centralDifference<Vec3>([this](const Vec3& y) { return eval(y); }, x, lattice); }
 };
 inline ScalarField div(VectorField field)
 { return ScalarField(new DivergenceField(field.node)); }
@@ -75,17 +171,29 @@ inline ScalarField div(VectorField field)
 //! Curl Operator
 struct CurlField : public VectorFieldNode {
   VFNodePtr field;
-  CurlField(VFNodePtr field) : field(field) { }
+  real lattice; //! Finest grid spacing under field
+  CurlField(VFNodePtr field) : field(field), lattice(latticeSpacing(*field)) { }
   Vec3 eval(const Vec3& x) const { 
-    Mat3 G = field->grad(x);
+    Mat3 G = field->evalWithGrad(x).grad;
     Vec3 r;
     r[0] = G(2,1) - G(1,2);
     r[1] = G(0,2) - G(2,0);
     r[2] = G(1,0) - G(0,1);
     return r;
   }
+  void evalBlock(const Vec3* xs, Vec3* out, size_t n) const
+  { for(size_t i=0;i<n;++i) out[i] = CurlField::eval(xs[i]); }
+  int compile(FieldCompiler& c, int x) const
+  { return c.emit<Vec3>(OpCurl, c.lowerGrad(*field, x)); }
+  void shape(FieldShape& s) const
+  { s(field); }
+  VFNodePtr simplify(FieldSimplifier& s) const {
+    const VFNodePtr sfield = s(field);
+    return sfield == field ? VFNodePtr() : adopt(new CurlField(sfield));
+  }
+  //! Differenced from the exact gradient of the field
   Mat3 grad(const Vec3& x) const
-	{	throw std::logic_error("Can not analytically create second derivatives..."); return Mat3::Zero(); }
+  { return centralDifference<Mat3>([this](const Vec3& y) { return eval(y); }, x, lattice); }
 };
 inline VectorField curl(VectorField field)
 { return VectorField(new CurlField(field.node)); }
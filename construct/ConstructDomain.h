@@ -23,6 +23,11 @@ struct Domain {
 	Vec3 position(int i, int j, int k) const {
 		return bmin + Vec3(i,j,k).cwiseProduct(H);
 	}
+
+	//! True if d has the same lattice points
+	bool sameLattice(const Domain& d) const {
+		return res[0] == d.res[0] && res[1] == d.res[1] && res[2] == d.res[2] && bmin == d.bmin && bmax == d.bmax;
+	}
 };
 };
 #endif
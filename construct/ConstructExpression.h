@@ -0,0 +1,353 @@
+#ifndef ConstructExpression_h
+#define ConstructExpression_h
+#include "construct/ConstructField.h"
+#include "construct/ConstructCalculus.h"
+#include "construct/ConstructGrid.h"
+namespace Construct {
+
+//////////////////////////////////////////////////////////
+// Static expressions: a compile-time mirror of the Field operators.
+// Each expression is its own type, so evaluating one is a single inlined
+// function with no virtual calls, and loops over points (see bake below)
+// compile down to one fused kernel. Use these for fixed kernels on the
+// hot path; toField() wraps an expression into a node wherever dynamic
+// composition is needed.
+namespace expr {
+
+//! Base of every static expression E. E::Value is the type of the field,
+//! E(x) its value at x and E.withGrad(x) its value and gradient there.
+//! E.spacing() is the finest lattice spacing of the grids it samples, 0
+//! if none (see ConstructFieldNode::spacing).
+template<typename E>
+struct Expr {
+  const E& self() const { return static_cast<const E&>(*this); }
+};
+
+//! Gradients of matrix valued expressions are not defined, as for fields
+template<typename T>
+inline ValueAndGrad<T> noGrad() {
+  throw std::logic_error("Can not take gradients of matrix fields in the Construct.");
+  return ValueAndGrad<T>();
+}
+
+//////////////////////////////////////////////////////////
+// Leaves
+
+//! Constant value
+template<typename T>
+struct Constant : public Expr<Constant<T> > {
+  typedef T Value;
+  T value;
+  Constant(const T& value) : value(value) { }
+  T operator()(const Vec3& x) const { return value; }
+  ValueAndGrad<T> withGrad(const Vec3& x) const
+  { return ValueAndGrad<T>(value, FieldInfo<typename FieldInfo<T>::GradType>::Zero()); }
+  real spacing() const { return 0; }
+};
+
+//! The sample point itself
+struct Identity : public Expr<Identity> {
+  typedef Vec3 Value;
+  Vec3 operator()(const Vec3& x) const { return x; }
+  ValueAndGrad<Vec3> withGrad(const Vec3& x) const
+  { return ValueAndGrad<Vec3>(x, Mat3::Identity()); }
+  real spacing() const { return 0; }
+};
+
+//! Trilinear sampling of a grid, inlined into the expression
+template<typename T>
+struct Sample : public Expr<Sample<T> > {
+  typedef T Value;
+  typename ConstructFieldNode<T>::ptr node; //! Keeps the grid alive
+  const ConstructGrid<T>* grid;
+  Sample(typename ConstructFieldNode<T>::ptr node)
+  : node(node), grid(dynamic_cast<const ConstructGrid<T>*>(node.get())) {
+    if(!grid) throw std::logic_error("expr::sample() needs a full-precision gridded field.");
+  }
+  T operator()(const Vec3& x) const { return grid->ConstructGrid<T>::eval(x); }
+  ValueAndGrad<T> withGrad(const Vec3& x) const
+  { return grid->ConstructGrid<T>::evalWithGrad(x); }
+  real spacing() const { return grid->ConstructGrid<T>::spacing(); }
+};
+
+//! Any dynamic field, called through its node
+template<typename T>
+struct Node : public Expr<Node<T> > {
+  typedef T Value;
+  typename ConstructFieldNode<T>::ptr node;
+  Node(typename ConstructFieldNode<T>::ptr node) : node(node) { }
+  T operator()(const Vec3& x) const { return node->eval(x); }
+  ValueAndGrad<T> withGrad(const Vec3& x) const { return node->evalWithGrad(x); }
+  real spacing() const { return latticeSpacing(*node); }
+};
+
+//////////////////////////////////////////////////////////
+// Arithmetic
+
+template<typename A, typename B>
+struct Sum : public Expr<Sum<A,B> > {
+  typedef typename A::Value Value;
+  A a; B b;
+  Sum(const A& a, const B& b) : a(a), b(b) { }
+  real spacing() const { return FieldShape::finer(a.spacing(), b.spacing()); }
+  Value operator()(const Vec3& x) const { return a(x) + b(x); }
+  ValueAndGrad<Value> withGrad(const Vec3& x) const {
+    const ValueAndGrad<Value> ga = a.withGrad(x), gb = b.withGrad(x);
+    return ValueAndGrad<Value>(ga.value + gb.value, ga.grad + gb.grad);
+  }
+};
+
+template<typename A, typename B>
+struct Difference : public Expr<Difference<A,B> > {
+  typedef typename A::Value Value;
+  A a; B b;
+  Difference(const A& a, const B& b) : a(a), b(b) { }
+  real spacing() const { return FieldShape::finer(a.spacing(), b.spacing()); }
+  Value operator()(const Vec3& x) const { return a(x) - b(x); }
+  ValueAndGrad<Value> withGrad(const Vec3& x) const {
+    const ValueAndGrad<Value> ga = a.withGrad(x), gb = b.withGrad(x);
+    return ValueAndGrad<Value>(ga.value - gb.value, ga.grad - gb.grad);
+  }
+};
+
+//! Result of Left * Right, and the product rule for it. The rules match
+//! those of MultiplicationField.
+template<typename Left, typename Right> struct ProductType;
+template<> struct ProductType<real,real> { typedef real Type; };
+template<> struct ProductType<Vec3,real> { typedef Vec3 Type; };
+template<> struct ProductType<real,Vec3> { typedef Vec3 Type; };
+template<> struct ProductType<Mat3,Vec3> { typedef Vec3 Type; };
+template<> struct ProductType<Mat3,Mat3> { typedef Mat3 Type; };
+template<> struct ProductType<Mat3,real> { typedef Mat3 Type; };
+template<> struct ProductType<real,Mat3> { typedef Mat3 Type; };
+
+template<typename Left, typename Right> struct ProductRule {
+  typedef typename ProductType<Left,Right>::Type Type;
+  static ValueAndGrad<Type> apply(const ValueAndGrad<Left>& a, const ValueAndGrad<Right>& b)
+  { return noGrad<Type>(); }
+};
+template<> struct ProductRule<real,real> {
+  static ValueAndGrad<real> apply(const ValueAndGrad<real>& a, const ValueAndGrad<real>& b)
+  { return ValueAndGrad<real>(a.value * b.value, a.grad * b.value + a.value * b.grad); }
+};
+template<> struct ProductRule<Vec3,real> {
+  static ValueAndGrad<Vec3> apply(const ValueAndGrad<Vec3>& a, const ValueAndGrad<real>& b)
+  { return ValueAndGrad<Vec3>(a.value * b.value, a.grad * b.value + a.value * b.grad.transpose()); }
+};
+template<> struct ProductRule<real,Vec3> {
+  static ValueAndGrad<Vec3> apply(const ValueAndGrad<real>& a, const ValueAndGrad<Vec3>& b)
+  { return ProductRule<Vec3,real>::apply(b, a); }
+};
+
+template<typename A, typename B>
+struct Product : public Expr<Product<A,B> > {
+  typedef typename ProductType<typename A::Value, typename B::Value>::Type Value;
+  A a; B b;
+  Product(const A& a, const B& b) : a(a), b(b) { }
+  real spacing() const { return FieldShape::finer(a.spacing(), b.spacing()); }
+  Value operator()(const Vec3& x) const { return a(x) * b(x); }
+  ValueAndGrad<Value> withGrad(const Vec3& x) const
+  { return ProductRule<typename A::Value, typename B::Value>::apply(a.withGrad(x), b.withGrad(x)); }
+};
+
+template<typename A, typename B>
+struct Quotient : public Expr<Quotient<A,B> > {
+  typedef typename A::Value Value;
+  A a; B b;
+  Quotient(const A& a, const B& b) : a(a), b(b) { }
+  real spacing() const { return FieldShape::finer(a.spacing(), b.spacing()); }
+  Value operator()(const Vec3& x) const { return a(x) / b(x); }
+  ValueAndGrad<Value> withGrad(const Vec3& x) const {
+    // a * (1/b), whose gradient is -b'/b^2
+    const ValueAndGrad<Value> ga = a.withGrad(x);
+    const ValueAndGrad<real> gb = b.withGrad(x);
+    const ValueAndGrad<Value> q = ProductRule<Value,real>::apply(ga,
+      ValueAndGrad<real>(1 / gb.value, -gb.grad / (gb.value * gb.value)));
+    return ValueAndGrad<Value>(ga.value / gb.value, q.grad);
+  }
+};
+
+//////////////////////////////////////////////////////////
+// Algebra and calculus
+
+template<typename V>
+struct Length : public Expr<Length<V> > {
+  typedef real Value;
+  V v;
+  Length(const V& v) : v(v) { }
+  real spacing() const { return v.spacing(); }
+  real operator()(const Vec3& x) const { return v(x).norm(); }
+  ValueAndGrad<real> withGrad(const Vec3& x) const {
+    const ValueAndGrad<Vec3> ve = v.withGrad(x);
+    const real norm = ve.value.norm();
+    return ValueAndGrad<real>(norm, ( ve.grad.transpose() * ve.value ) / (static_cast<real>(1.e-5) + norm));
+  }
+};
+
+template<typename A, typename B>
+struct Dot : public Expr<Dot<A,B> > {
+  typedef real Value;
+  A a; B b;
+  Dot(const A& a, const B& b) : a(a), b(b) { }
+  real spacing() const { return FieldShape::finer(a.spacing(), b.spacing()); }
+  real operator()(const Vec3& x) const { return a(x).dot(b(x)); }
+  ValueAndGrad<real> withGrad(const Vec3& x) const {
+    const ValueAndGrad<Vec3> ga = a.withGrad(x), gb = b.withGrad(x);
+    return ValueAndGrad<real>(ga.value.dot(gb.value), ga.grad.transpose()*gb.value + gb.grad.transpose()*ga.value);
+  }
+};
+
+template<typename A, typename B>
+struct Cross : public Expr<Cross<A,B> > {
+  typedef Vec3 Value;
+  A a; B b;
+  Cross(const A& a, const B& b) : a(a), b(b) { }
+  real spacing() const { return FieldShape::finer(a.spacing(), b.spacing()); }
+  Vec3 operator()(const Vec3& x) const { return a(x).cross(b(x)); }
+  ValueAndGrad<Vec3> withGrad(const Vec3& x) const {
+    const ValueAndGrad<Vec3> fv = a.withGrad(x), gv = b.withGrad(x);
+    const Mat3 &df = fv.grad, &dg = gv.grad;
+    const Vec3 &fx = fv.value, &gx = gv.value;
+    Mat3 result;
+    result.row(0) = gx.z()*df.row(1) + fx.y()*dg.row(2) - fx.z()*dg.row(1) - gx.y()*df.row(2);
+    result.row(1) = gx.x()*df.row(2) + fx.z()*dg.row(0) - fx.x()*dg.row(2) - gx.z()*df.row(0);
+    result.row(2) = gx.y()*df.row(0) + fx.x()*dg.row(1) - fx.y()*dg.row(0) - gx.x()*df.row(1);
+    return ValueAndGrad<Vec3>(fx.cross(gx), result);
+  }
+};
+
+//! f(g(x))
+template<typename F, typename G>
+struct Warp : public Expr<Warp<F,G> > {
+  typedef typename F::Value Value;
+  F f; G g;
+  Warp(const F& f, const G& g) : f(f), g(g) { }
+  real spacing() const { return FieldShape::finer(f.spacing(), g.spacing()); }
+  Value operator()(const Vec3& x) const { return f(g(x)); }
+  ValueAndGrad<Value> withGrad(const Vec3& x) const {
+    const ValueAndGrad<Vec3> gx = g.withGrad(x);
+    const ValueAndGrad<Value> fg = f.withGrad(gx.value);
+    return ValueAndGrad<Value>(fg.value, gx.grad * fg.grad);
+  }
+};
+
+//! Second derivatives, as for GradField: central differences of the
+//! exact gradient, for scalar expressions only
+template<typename T> struct Hessian {
+  template<typename E>
+  static ValueAndGrad<typename FieldInfo<T>::GradType> apply(const E& e, const Vec3& x, real spacing)
+  { throw std::logic_error("Can not analytically create second derivatives..."); }
+};
+template<> struct Hessian<real> {
+  template<typename E>
+  static ValueAndGrad<Vec3> apply(const E& e, const Vec3& x, real spacing) {
+    const Mat3 H = centralDifference<Mat3>([&](const Vec3& y) { return e.withGrad(y).grad; }, x, spacing);
+    return ValueAndGrad<Vec3>(e.withGrad(x).grad, H);
+  }
+};
+
+template<typename E>
+struct Gradient : public Expr<Gradient<E> > {
+  typedef typename FieldInfo<typename E::Value>::GradType Value;
+  E e;
+  real lattice; //! e.spacing(), found once
+  Gradient(const E& e) : e(e), lattice(e.spacing()) { }
+  Value operator()(const Vec3& x) const { return e.withGrad(x).grad; }
+  ValueAndGrad<Value> withGrad(const Vec3& x) const
+  { return Hessian<typename E::Value>::apply(e, x, lattice); }
+  real spacing() const { return lattice; }
+};
+
+//////////////////////////////////////////////////////////
+// Builders, mirroring the Field API
+
+inline Identity identity() { return Identity(); }
+template<typename T> inline Constant<T> constant(const T& value) { return Constant<T>(value); }
+template<typename T> inline Sample<T> sample(const Field<T>& grid) { return Sample<T>(grid.node); }
+template<typename T> inline Node<T> field(const Field<T>& f) { return Node<T>(f.node); }
+
+template<typename A, typename B>
+inline Sum<A,B> operator+(const Expr<A>& a, const Expr<B>& b) { return Sum<A,B>(a.self(), b.self()); }
+template<typename A, typename B>
+inline Difference<A,B> operator-(const Expr<A>& a, const Expr<B>& b) { return Difference<A,B>(a.self(), b.self()); }
+template<typename A, typename B>
+inline Product<A,B> operator*(const Expr<A>& a, const Expr<B>& b) { return Product<A,B>(a.self(), b.self()); }
+template<typename A, typename B>
+inline Quotient<A,B> operator/(const Expr<A>& a, const Expr<B>& b) { return Quotient<A,B>(a.self(), b.self()); }
+
+// Scalars mix in directly
+template<typename A>
+inline Product<A,Constant<real> > operator*(const Expr<A>& a, real s) { return Product<A,Constant<real> >(a.self(), s); }
+template<typename A>
+inline Product<Constant<real>,A> operator*(real s, const Expr<A>& a) { return Product<Constant<real>,A>(s, a.self()); }
+template<typename A>
+inline Quotient<A,Constant<real> > operator/(const Expr<A>& a, real s) { return Quotient<A,Constant<real> >(a.self(), s); }
+
+template<typename V>
+inline Length<V> length(const Expr<V>& v) { return Length<V>(v.self()); }
+template<typename A, typename B>
+inline Dot<A,B> dot(const Expr<A>& a, const Expr<B>& b) { return Dot<A,B>(a.self(), b.self()); }
+template<typename A, typename B>
+inline Cross<A,B> cross(const Expr<A>& a, const Expr<B>& b) { return Cross<A,B>(a.self(), b.self()); }
+template<typename F, typename G>
+inline Warp<F,G> warp(const Expr<F>& f, const Expr<G>& g) { return Warp<F,G>(f.self(), g.self()); }
+template<typename E>
+inline Gradient<E> grad(const Expr<E>& e) { return Gradient<E>(e.self()); }
+
+//////////////////////////////////////////////////////////
+// Evaluation
+
+//! A static expression as a field node, for dynamic composition. Blocks
+//! of points run through one inlined loop.
+template<typename E>
+struct ExpressionField : public ConstructFieldNode<typename E::Value> {
+  typedef typename E::Value T;
+  E e;
+  ExpressionField(const E& e) : e(e) { }
+  T eval(const Vec3& x) const { return e(x); }
+  void evalBlock(const Vec3* xs, T* out, size_t n) const
+  { for(size_t i=0;i<n;++i) out[i] = e(xs[i]); }
+  typename FieldInfo<T>::GradType grad(const Vec3& x) const { return e.withGrad(x).grad; }
+  ValueAndGrad<T> evalWithGrad(const Vec3& x) const { return e.withGrad(x); }
+  real spacing() const { return e.spacing(); }
+};
+
+template<typename E>
+inline Field<typename E::Value> toField(const Expr<E>& e)
+{ return Field<typename E::Value>(new ExpressionField<E>(e.self())); }
+
+//! Evaluates e at every lattice point of grid with a single fused loop
+template<typename E>
+inline void bake(ConstructGrid<typename E::Value>& grid, const Expr<E>& expression) {
+  const E& e = expression.self();
+  const Domain& domain = grid.domain;
+  typename E::Value* data = grid.data;
+  grid.forEachTile([&](const int* lo, const int* hi) {
+    for(int k=lo[2];k<hi[2];++k)
+    for(int j=lo[1];j<hi[1];++j)
+    for(int i=lo[0];i<hi[0];++i)
+      data[grid.index(i,j,k)] = e(domain.position(i,j,k));
+  });
+  grid.fillHalo();
+}
+
+//! Bakes e, evaluated on the current state, to the next state of buffer
+template<typename E>
+inline void bake(GridBuffer<typename E::Value>& buffer, const Expr<E>& e) {
+  bake(buffer.back(), e);
+  buffer.swap();
+}
+
+//! As Construct::writeToGrid, for a static expression
+template<typename E>
+inline Field<typename E::Value> writeToGrid(const Expr<E>& e, Field<typename E::Value> outside, Domain domain,
+  int halo = 0, HaloRule rule = HaloOutside, GridLayout layout = LayoutLinear,
+  GridInterpolation interpolation = InterpolateLinear) {
+  ConstructGrid<typename E::Value>* grid = new ConstructGrid<typename E::Value>(domain, outside.node, halo, rule, layout, interpolation);
+  bake(*grid, e);
+  return Field<typename E::Value>(grid);
+}
+
+};
+};
+#endif
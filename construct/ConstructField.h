@@ -2,7 +2,13 @@
 #define ConstructField_h
 
 #include <memory>
+#include <map>
+#include <vector>
+#include <typeinfo>
+#include <cstddef>
+#include <cstdint>
 #include "construct/ConstructBase.h"
+#include "construct/ConstructPool.h"
 namespace Construct {
 
 template<typename> struct FieldInfo;
@@ -19,6 +25,20 @@ template<> struct FieldInfo<Mat3> {
   static inline Mat3 Zero() { return Mat3::Zero(); }
 };
 
+//! The value of a field at a point together with its gradient there
+template<typename T>
+struct ValueAndGrad {
+  typedef typename FieldInfo<T>::GradType GradType;
+  T value;
+  GradType grad;
+  ValueAndGrad() { }
+  ValueAndGrad(const T& value, const GradType& grad) : value(value), grad(grad) { }
+};
+
+struct FieldCompiler;
+struct FieldSimplifier;
+struct FieldShape;
+
 //////////////////////////////////////////////////////////
 // Field node types. Each is evaluatable and possibly once differentiable
 template<typename T>
@@ -26,8 +46,48 @@ struct ConstructFieldNode {
   typedef std::shared_ptr<ConstructFieldNode<T> > ptr;
   virtual T eval(const Vec3& x) const = 0;
 	virtual ~ConstructFieldNode() { }
+
+  //! Expressions are rebuilt every step, so nodes come from the NodePool
+  static void* operator new(size_t bytes) { return NodePool::allocate(bytes); }
+  static void operator delete(void* p, size_t bytes) { NodePool::deallocate(p, bytes); }
+
+  //! Evaluates the field at n <= BlockSize points. Nodes override this to
+  //! pay for virtual dispatch once per block of points instead of once per
+  //! point. The output array must not overlap the input points.
+  virtual void evalBlock(const Vec3* xs, T* out, size_t n) const
+  { for(size_t i=0;i<n;++i) out[i] = eval(xs[i]); }
+
+  //! Lowers this node into a compiled program (see ConstructProgram.h),
+  //! returning the register which holds its value at the points in vector
+  //! register x. By default the node is called as an opaque leaf.
+  virtual int compile(FieldCompiler& c, int x) const;
+  //! As compile, for the gradient of this node. By default the node's
+  //! grad() is called point by point as an opaque leaf.
+  virtual int compileGrad(FieldCompiler& c, int x) const;
+
+  //! Returns a cheaper node computing the same field, built from the
+  //! simplified children s(child), or null if this node is as simple as
+  //! it gets. Nodes without children have nothing to simplify.
+  virtual ptr simplify(FieldSimplifier& s) const { return ptr(); }
+
+  //! Describes the structure of this node to s: visits each child the
+  //! lowering reads with s(child) and binds the data it reads (constants)
+  //! with s.bind. Nodes which are lowered as opaque leaves have nothing
+  //! to describe; their type alone is their shape.
+  virtual void shape(FieldShape& s) const { }
+
+  //! The lattice spacing of the samples this node reads itself (the
+  //! smallest cell size of a grid), or 0 if it reads none. Derivatives
+  //! differenced through the node step by no less (see differenceStep).
+  virtual real spacing() const { return 0; }
+
   virtual typename FieldInfo<T>::GradType grad(const Vec3& x) const 
   { return FieldInfo<typename FieldInfo<T>::GradType>::Zero(); } 
+
+  //! Forward-mode differentiation: the value and gradient in one pass.
+  //! Composite nodes override this to visit each child once per point.
+  virtual ValueAndGrad<T> evalWithGrad(const Vec3& x) const
+  { return ValueAndGrad<T>(eval(x), grad(x)); }
 };
 
 template<> Mat3 ConstructFieldNode<Mat3>::grad(const Vec3& x) const {
@@ -35,6 +95,21 @@ template<> Mat3 ConstructFieldNode<Mat3>::grad(const Vec3& x) const {
 	return Mat3::Zero();
 }
 
+//! Takes ownership of a new node. Its reference count is allocated from
+//! the NodePool as well.
+template<typename T>
+inline std::shared_ptr<ConstructFieldNode<T> > adopt(ConstructFieldNode<T>* node) {
+  return std::shared_ptr<ConstructFieldNode<T> >(node, 
+    std::default_delete<ConstructFieldNode<T> >(), PoolAllocator<ConstructFieldNode<T> >());
+}
+
+//! Evaluates a node at any number of points, BlockSize points at a time
+template<typename T>
+inline void evalBlocks(const ConstructFieldNode<T>& node, const Vec3* xs, T* out, size_t n) {
+  for(size_t s=0;s<n;s+=BlockSize)
+    node.evalBlock(xs+s, out+s, n-s < (size_t)BlockSize ? n-s : (size_t)BlockSize);
+}
+
 typedef ConstructFieldNode<real> ScalarFieldNode;
 typedef ConstructFieldNode<Vec3> VectorFieldNode;
 typedef ConstructFieldNode<Mat3> MatrixFieldNode;
@@ -49,11 +124,133 @@ struct ConstantField : public ConstructFieldNode<T> {
   ConstantField() : value(FieldInfo<T>::Zero()) { } 
   ConstantField(const T& value) : value(value) { }
   T eval(const Vec3& x) const { return value; }
+  void evalBlock(const Vec3* xs, T* out, size_t n) const
+  { for(size_t i=0;i<n;++i) out[i] = value; }
+  int compile(FieldCompiler& c, int x) const;
+  int compileGrad(FieldCompiler& c, int x) const;
   GradType grad(const Vec3& x) const { return FieldInfo<GradType>::Zero(); }
+  ValueAndGrad<T> evalWithGrad(const Vec3& x) const
+  { return ValueAndGrad<T>(value, grad(x)); }
+  void shape(FieldShape& s) const;
 };
 template<> Mat3 ConstantField<Mat3>::grad(const Vec3& x) const
 { throw std::logic_error("Can not take gradients of matrix fields in the Construct."); }
 
+//////////////////////////////////////////////////////////
+//! Rewrites an expression bottom-up through each node's simplify().
+//! Every node is simplified once, so shared subexpressions stay shared.
+struct FieldSimplifier {
+  std::map<const void*, std::shared_ptr<void> > simplified;
+
+  //! The simplified form of a node
+  template<typename T>
+  std::shared_ptr<ConstructFieldNode<T> > operator()(const std::shared_ptr<ConstructFieldNode<T> >& node) {
+    std::shared_ptr<void>& known = simplified[node.get()];
+    if(!known) {
+      std::shared_ptr<ConstructFieldNode<T> > s = node->simplify(*this);
+      known = s ? s : node;
+    }
+    return std::static_pointer_cast<ConstructFieldNode<T> >(known);
+  }
+
+  //! The constant a node holds, if it is a constant
+  template<typename T>
+  static const ConstantField<T>* constant(const std::shared_ptr<ConstructFieldNode<T> >& node)
+  { return dynamic_cast<const ConstantField<T>*>(node.get()); }
+
+  template<typename T>
+  static bool zero(const std::shared_ptr<ConstructFieldNode<T> >& node) {
+    const ConstantField<T>* c = constant(node);
+    return c && c->value == FieldInfo<T>::Zero();
+  }
+
+  //! True for the multiplicative identity of reals and matrices
+  static bool one(const std::shared_ptr<ConstructFieldNode<real> >& node) {
+    const ConstantField<real>* c = constant(node);
+    return c && c->value == static_cast<real>(1);
+  }
+  static bool one(const std::shared_ptr<ConstructFieldNode<Vec3> >& node) { return false; }
+  static bool one(const std::shared_ptr<ConstructFieldNode<Mat3> >& node) {
+    const ConstantField<Mat3>* c = constant(node);
+    return c && c->value == Mat3::Identity();
+  }
+
+  //! Replaces a node whose inputs are all constant by its value
+  template<typename T>
+  static std::shared_ptr<ConstructFieldNode<T> > fold(ConstructFieldNode<T>* node) {
+    const std::shared_ptr<ConstructFieldNode<T> > folded = adopt(node);
+    return adopt(new ConstantField<T>(folded->eval(Vec3::Zero())));
+  }
+};
+
+//////////////////////////////////////////////////////////
+//! Structural hash of an expression DAG. Expressions hash alike when the
+//! same node types are wired together the same way, whatever grids they
+//! sample and whatever values their constants hold. Those are recorded
+//! instead, in visiting order, as the bindings of the expression: a plan
+//! built for one expression is reused for another of the same shape by
+//! swapping in its bindings (see Plan in ConstructProgram.h).
+struct FieldShape {
+  typedef std::pair<const void*, int> Item;
+
+  //! The finer of two lattice spacings, 0 standing for none
+  static real finer(real a, real b) { return a == 0 ? b : b == 0 || a < b ? a : b; }
+
+  uint64_t hash;
+  std::vector<const void*> nodes;  //! Every node, in visiting order
+  std::map<const void*, int> ids;  //! Index of each node in nodes
+  std::vector<real> reals;         //! Bound constants, in binding order
+  std::vector<Vec3> vectors;
+  std::vector<Mat3> matrices;
+  std::map<Item, int> slots;       //! Index of (node, item) in its constant table
+  std::vector<uint64_t> code;      //! Every value mixed into hash: the shape itself
+  real spacing;                    //! Finest spacing of the nodes; not part of the shape
+
+  FieldShape() : hash(14695981039346656037ULL), spacing(0) { }
+
+  //! Visit a node. A node reached twice hashes as a reference to its
+  //! first visit, so shared subexpressions are part of the shape.
+  template<typename T>
+  void operator()(const std::shared_ptr<ConstructFieldNode<T> >& node) { (*this)(*node); }
+  template<typename T>
+  void operator()(const ConstructFieldNode<T>& node) {
+    std::map<const void*, int>::const_iterator it = ids.find(&node);
+    if(it != ids.end()) { mix(1); mix(it->second); return; }
+    ids[&node] = nodes.size();
+    nodes.push_back(&node);
+    spacing = finer(spacing, node.spacing());
+    mix(2); mix(typeid(node).hash_code());
+    node.shape(*this);
+    mix(3);
+  }
+
+  bool contains(const void* node) const { return ids.find(node) != ids.end(); }
+
+  //! Record a constant read by node as its item'th binding
+  void bind(const void* node, int item, const real& value) { bind(node, item, value, reals); }
+  void bind(const void* node, int item, const Vec3& value) { bind(node, item, value, vectors); }
+  void bind(const void* node, int item, const Mat3& value) { bind(node, item, value, matrices); }
+
+  //! Mix a value which is part of the shape, such as a flag changing how a node lowers
+  void mix(uint64_t v) {
+    code.push_back(v);
+    hash = (hash ^ v) * 1099511628211ULL;
+    hash ^= hash >> 29;
+  }
+
+private:
+  template<typename T>
+  void bind(const void* node, int item, const T& value, std::vector<T>& table) {
+    slots[Item(node, item)] = table.size();
+    table.push_back(value);
+    mix(4); mix(item);
+  }
+};
+
+template<typename T>
+void ConstantField<T>::shape(FieldShape& s) const
+{ s.bind(this, 0, value); }
+
 typedef ConstantField<real> ConstantScalarField;
 typedef ConstantField<Vec3> ConstantVectorField;
 typedef ConstantField<Mat3> ConstantMatrixField;
@@ -65,10 +262,10 @@ template<typename T>
 struct Field {
   typedef typename ConstructFieldNode<T>::ptr NodePtr;
   NodePtr node;
-  Field() : node(NodePtr(new ConstantField<T>())) {}
-  Field(const T& value) : node(NodePtr(new ConstantField<T>(value))) { }
+  Field() : node(adopt<T>(new ConstantField<T>())) {}
+  Field(const T& value) : node(adopt<T>(new ConstantField<T>(value))) { }
 
-  Field(ConstructFieldNode<T>* node) : node(NodePtr(node)) { }
+  Field(ConstructFieldNode<T>* node) : node(adopt(node)) { }
   Field(NodePtr node) : node(node) { }
 
   //! Evaluates the underlying expression tree
@@ -76,10 +273,18 @@ struct Field {
   { return node->eval(x); }
   T operator()(const Vec3& x) const
   { return eval(x); }
+
+  //! Evaluates the underlying expression tree at n points
+  void evalBlock(const Vec3* xs, T* out, size_t n) const
+  { evalBlocks(*node, xs, out, n); }
   
   // Return the gradient of this expression
   typename FieldInfo<T>::GradType grad(const Vec3& x) const
   { return node->grad(x); }
+
+  //! Value and gradient of this expression together
+  ValueAndGrad<T> evalWithGrad(const Vec3& x) const
+  { return node->evalWithGrad(x); }
 };
 
 template<> Mat3 Field<Mat3>::grad(const Vec3& x) const
@@ -99,5 +304,31 @@ template<typename T>
 inline Field<T> constant(T value)
 { return Field<T>(value); }
 
+//! An equivalent expression with constant subexpressions folded,
+//! identity operations removed and affine warps collapsed
+template<typename T>
+inline Field<T> simplify(Field<T> field) {
+  FieldSimplifier s;
+  return Field<T>(s(field.node));
+}
+
+//! Structural hash of an expression; see FieldShape
+template<typename T>
+inline uint64_t shapeHash(const Field<T>& field) {
+  FieldShape s;
+  s(field.node);
+  return s.hash;
+}
+
+//! Finest lattice spacing of the grids under node, 0 if none
+template<typename T>
+inline real latticeSpacing(const ConstructFieldNode<T>& node) {
+  FieldShape s;
+  s(node);
+  return s.spacing;
+}
+
 };
+
+#include "construct/ConstructProgram.h"
 #endif
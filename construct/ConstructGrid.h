@@ -2,10 +2,89 @@
 #define ConstructGrid_h
 #include "construct/ConstructField.h"
 #include "construct/ConstructDomain.h"
+#include "construct/ConstructSIMD.h"
+#include "construct/ConstructStorage.h"
 #include <iostream>
+#include <vector>
+#include <algorithm>
+#include <memory>
+#include <cstring>
 namespace Construct {
 
+struct GridWorkspace;
+
+//! How the ghost cells of a padded grid are filled
+enum HaloRule {
+	HaloOutside,  //! From the outside field, as unpadded grids read them
+	HaloClamp,    //! Copy of the nearest lattice point
+	HaloPeriodic  //! Wrapped around to the opposite side
+};
+
+//! Order of grid values in memory
+enum GridLayout {
+	LayoutLinear,  //! Row-major, x fastest
+	LayoutBricked  //! 8x8x8 bricks, each row-major, stored x fastest
+};
+
+//! How grids reconstruct values between lattice points
+enum GridInterpolation {
+	InterpolateLinear,   //! Trilinear
+	InterpolateCubic,    //! Catmull-Rom tricubic: sharper, but may overshoot
+	InterpolateMonotone  //! Tricubic clamped on each axis to the two middle samples
+};
+
+//! How projections solve for pressure
+enum PoissonSolver {
+	SolverCG,          //! Conjugate Gradient
+	SolverMultigrid,   //! Geometric multigrid V-cycles, red-black Gauss-Seidel smoothed
+	SolverMICCG,       //! CG preconditioned by modified incomplete Cholesky, MIC(0)
+	SolverMultigridCG  //! CG preconditioned by one multigrid V-cycle
+};
+
+//! When a pressure solve stops. Built from an iteration count alone, it
+//! stops when the largest residual falls to 1e-4.
+struct ConvergencePolicy {
+	enum Norm {
+		NormLinf,  //! The largest residual magnitude of a fluid cell
+		NormL2     //! The root of the sum of squared residuals
+	};
+	int iterations;  //! At most this many iterations (V-cycles for multigrid)
+	real absolute;   //! Converged when the residual norm is at most this,
+	real relative;   //! or at most this times the initial one
+	Norm norm;
+	bool warmStart;  //! Start from the pressure already held (by the workspace, for divFree), rather than 0
+
+	ConvergencePolicy(int iterations = 50, real absolute = 1.e-4f, real relative = 0, Norm norm = NormLinf, bool warmStart = false)
+	: iterations(iterations), absolute(absolute), relative(relative), norm(norm), warmStart(warmStart) { }
+
+	//! The norm of a residual, from its largest magnitude and sum of squares
+	real measure(real largest, real squares) const { return norm == NormL2 ? std::sqrt(squares) : largest; }
+	bool converged(real residual, real initial) const { return residual <= absolute || residual <= relative * initial; }
+};
+
+//! How a pressure solve went, in the norm of its policy. Every solver
+//! measures residuals against the same right-hand side: the divergence
+//! less its mean over fluid cells (see solvePressure).
+struct SolverStats {
+	int iterations;
+	real initialResidual, residual;
+	bool converged;
+	SolverStats() : iterations(0), initialResidual(0), residual(0), converged(false) { }
+};
+
+//! Gradient of a grid from the derivatives d[0..2] of its values along
+//! x, y and z, by value type
 template<typename T>
+struct GridGradient {
+	static typename FieldInfo<T>::GradType of(const T* d) {
+		throw std::logic_error("Gradient of Matrix Field not supported");
+		return FieldInfo<typename FieldInfo<T>::GradType>::Zero(); 
+	}
+};
+
+//! Grids hold values of type T at full precision, or converted to a
+//! smaller type by storage policy S (see ConstructStorage.h)
+template<typename T, typename S = StoreFloat>
 struct ConstructGrid : public ConstructFieldNode<T> {
 	//! Domain definition for this grid
 	Domain domain;
@@ -13,48 +92,242 @@ struct ConstructGrid : public ConstructFieldNode<T> {
 	//! The field which should be queried if something
 	//! tries to access outside of this grid
 	typename ConstructFieldNode<T>::ptr outside_field;
+
+	//! Ghost cells stored around the lattice on every side (0 to 3), and
+	//! how fillHalo() fills them. Reads within the halo need no bounds
+	//! checks and never call the outside field.
+	int halo;
+	HaloRule rule;
+
+	//! Bricked grids keep the neighborhood of every point within a few
+	//! cache lines, for sampling at scattered points of large domains
+	GridLayout layout;
+	enum { Brick = 8, BrickVolume = Brick * Brick * Brick };
+
+	//! Cubic interpolation keeps features sharp through repeated
+	//! resampling, as in semi-Lagrangian advection
+	GridInterpolation interpolation;
 	
-	//! Grid storage
-	T *data;
+	typedef Storage<T,S> Codec;
+	typedef typename Codec::Stored Stored;
+
+	//! Grid storage, recycled through the BufferPool
+	Stored *data;
+
+	//! Range of quantized storage: values are offset + scale * q. Baking
+	//! and loading fit it to the values; set() clamps to it.
+	real scale, offset;
 
-	ConstructGrid(Domain domain, typename ConstructFieldNode<T>::ptr outside_field) 
-	: domain(domain), outside_field(outside_field) { 
-		data = new T[domain.res[0] * domain.res[1] * domain.res[2]];	
+	ConstructGrid(Domain domain, typename ConstructFieldNode<T>::ptr outside_field, 
+		int halo = 0, HaloRule rule = HaloOutside, GridLayout layout = LayoutLinear, 
+		GridInterpolation interpolation = InterpolateLinear) 
+	: domain(domain), outside_field(outside_field), halo(halo), rule(rule), layout(layout), interpolation(interpolation) { 
+		if(halo < 0 || halo > 3) throw std::logic_error("Grid halos are 0 to 3 cells wide in the Construct.");
+		// Recycled buffers hold another grid's values: zero them too, so a
+		// new grid always reads 0 until it is baked or set
+		data = BufferPool<Stored>::acquire(size());
+		firstTouch();
+		S::range(0, 1, scale, offset);
 	}
 
-	~ConstructGrid() { delete[] data; }
+	~ConstructGrid() { BufferPool<Stored>::release(data, size()); }
 
-	//! 1D array index of a 3D lattice index 
-	inline int index(int i, int j, int k) const 
-	{	return (k * domain.res[1] + j) * domain.res[0] + i; }
+	//! Stored values per axis, including ghost cells
+	inline int padded(int axis) const { return domain.res[axis] + 2 * halo; }
+
+	//! Bricks per axis, covering the lattice and halo
+	inline int bricks(int axis) const { return (padded(axis) + Brick - 1) / Brick; }
+
+	//! Number of stored values, including ghost cells
+	size_t size() const { 
+		if(layout == LayoutBricked) return (size_t)bricks(0) * bricks(1) * bricks(2) * BrickVolume;
+		return (size_t)padded(0) * padded(1) * padded(2); 
+	}
+
+	//! 1D array index of a 3D lattice index. Ghost cells have indices
+	//! -halo..-1 and res..res+halo-1.
+	inline int index(int i, int j, int k) const {
+		const int pi = i + halo, pj = j + halo, pk = k + halo;
+		if(layout == LayoutLinear) return (pk * padded(1) + pj) * padded(0) + pi;
+		const int brick = ((pk / Brick) * bricks(1) + pj / Brick) * bricks(0) + pi / Brick;
+		return brick * BrickVolume + ((pk % Brick) * Brick + pj % Brick) * Brick + pi % Brick;
+	}
+
+	//! True if (i,j,k) is stored, on the lattice or in the halo
+	inline bool stored(int i, int j, int k) const {
+		return (unsigned)(i + halo) < (unsigned)padded(0) && 
+			(unsigned)(j + halo) < (unsigned)padded(1) && 
+			(unsigned)(k + halo) < (unsigned)padded(2);
+	}
 
 	//! Return data located at lattice point (i,j,k)
 	inline T get(int i, int j, int k) const {
-		if(!domain.inside(i,j,k))
+		if(!stored(i,j,k))
 			return outside_field->eval(domain.position(i,j,k));
 		else
-			return data[ index(i,j,k) ];
+			return Codec::decode(data[ index(i,j,k) ], scale, offset);
 	}
 	
   //! Guaranteed Safe Get (For when there is no possibility of accessing outside)
   inline T gets(int i, int j, int k) const {
-		return data[ index(i,j,k) ];
+		return Codec::decode(data[ index(i,j,k) ], scale, offset);
 	}
 
 	inline void set(int i, int j, int k, const T& value) {
-		data[index(i,j,k)] = value;
+		data[index(i,j,k)] = Codec::encode(value, scale, offset);
 	}
 
-	void bakeData(typename ConstructFieldNode<T>::ptr source) {
+	//! Fit the quantized range to the n values at v
+	void fitRange(const T* v, size_t n) {
+		const real* r = Scalars<T>::ptr(v);
+		real lo = n ? r[0] : 0, hi = lo;
+		for(size_t c=0;c<n*Scalars<T>::Count;++c) { lo = std::min(lo, r[c]); hi = std::max(hi, r[c]); }
+		S::range(lo, hi, scale, offset);
+	}
+
+	//! Value of the ghost cell (i,j,k) under the halo rule
+	T ghost(int i, int j, int k) const {
+		const int* r = domain.res;
+		switch(rule) {
+			case HaloClamp:
+				return gets(std::min(std::max(i,0),r[0]-1), std::min(std::max(j,0),r[1]-1), std::min(std::max(k,0),r[2]-1));
+			case HaloPeriodic:
+				return gets((i%r[0]+r[0])%r[0], (j%r[1]+r[1])%r[1], (k%r[2]+r[2])%r[2]);
+			default:
+				return outside_field->eval(domain.position(i,j,k));
+		}
+	}
+
+	//! Refill the ghost cells from the lattice (or outside field). Baking
+	//! does this; call it after changing lattice values through set().
+	void fillHalo() {
+		if(!halo) return;
+		const int* r = domain.res;
 		#pragma omp parallel for
-		for(int j=0;j<domain.res[1];++j)
-		for(int k=0;k<domain.res[2];++k) 
-		for(int i=0;i<domain.res[0];++i) {
-			Vec3 x = domain.position(i,j,k);
-			data[index(i,j,k)] = source->eval(x);
+		for(int k=-halo;k<r[2]+halo;++k)
+		for(int j=-halo;j<r[1]+halo;++j) {
+			const bool ghostRow = j < 0 || k < 0 || j >= r[1] || k >= r[2];
+			for(int i=-halo;i<r[0]+halo;++i) {
+				if(!ghostRow && i == 0) i = r[0]; // Skip over the lattice
+				set(i,j,k, ghost(i,j,k));
+			}
+		}
+	}
+
+	//! Calls f(lo, hi) in parallel for each tile of storage: the box of
+	//! lattice points lo <= (i,j,k) < hi in one x-row of a linear grid, or
+	//! in one brick of a bricked grid. Points of a tile visited with x
+	//! fastest are visited in storage order.
+	template<typename F>
+	void forEachTile(F f) const {
+		const int* r = domain.res;
+		if(layout == LayoutLinear) {
+			#pragma omp parallel for
+			for(int t=0;t<r[1]*r[2];++t) {
+				const int j = t % r[1], k = t / r[1];
+				const int lo[3] = { 0, j, k }, hi[3] = { r[0], j+1, k+1 };
+				f(lo, hi);
+			}
+			return;
+		}
+		const int nb[3] = { bricks(0), bricks(1), bricks(2) };
+		#pragma omp parallel for
+		for(int b=0;b<nb[0]*nb[1]*nb[2];++b) {
+			const int corner[3] = { (b % nb[0]) * Brick - halo, (b / nb[0] % nb[1]) * Brick - halo, b / (nb[0] * nb[1]) * Brick - halo };
+			int lo[3], hi[3];
+			for(int a=0;a<3;++a) { lo[a] = std::max(corner[a], 0); hi[a] = std::min(corner[a] + (int)Brick, r[a]); }
+			if(lo[0] < hi[0] && lo[1] < hi[1] && lo[2] < hi[2]) f(lo, hi);
+		}
+	}
+
+	//! Zero storage, the lattice with the partition that bakes use, so on
+	//! NUMA machines each thread's tiles of new memory land in its own
+	//! node's memory; then the halo
+	void firstTouch() {
+		forEachTile([&](const int* lo, const int* hi) {
+			for(int k=lo[2];k<hi[2];++k)
+			for(int j=lo[1];j<hi[1];++j)
+			for(int i=lo[0];i<hi[0];++i) memset(static_cast<void*>(data + index(i,j,k)), 0, sizeof(Stored));
+		});
+		if(!halo) return;
+		const int* r = domain.res;
+		#pragma omp parallel for
+		for(int k=-halo;k<r[2]+halo;++k)
+		for(int j=-halo;j<r[1]+halo;++j) {
+			const bool ghostRow = j < 0 || k < 0 || j >= r[1] || k >= r[2];
+			for(int i=-halo;i<r[0]+halo;++i) {
+				if(!ghostRow && i == 0) i = r[0]; // Skip over the lattice
+				memset(static_cast<void*>(data + index(i,j,k)), 0, sizeof(Stored));
+			}
 		}
 	}
 
+	//! Set every lattice point to value, and refill the halo. Cheaper than
+	//! baking a constant field; quantized grids fit their range to value.
+	void fill(const T& value) {
+		if(S::Quantized) fitRange(&value, 1);
+		const Stored q = Codec::encode(value, scale, offset);
+		forEachTile([&](const int* lo, const int* hi) {
+			for(int k=lo[2];k<hi[2];++k)
+			for(int j=lo[1];j<hi[1];++j) {
+				Stored* row = data + index(lo[0],j,k);
+				std::fill(row, row + (hi[0] - lo[0]), q);
+			}
+		});
+		fillHalo();
+	}
+
+	//! Evaluate source at every lattice point, tile by tile in blocks of
+	//! points. The source is compiled to a flat program once up front.
+	//! Quantized grids bake at full precision first, to fit their range.
+	void bakeData(typename ConstructFieldNode<T>::ptr source) {
+		if(S::Quantized) { bakeQuantized(source); return; }
+		const CompiledField<T> program(source);
+		forEachTile([&](const int* lo, const int* hi) {
+			Vec3 xs[BlockSize];
+			T values[BlockSize];
+			int at[BlockSize];
+			size_t n = 0;
+			for(int k=lo[2];k<hi[2];++k)
+			for(int j=lo[1];j<hi[1];++j)
+			for(int i=lo[0];i<hi[0];++i) {
+				xs[n] = domain.position(i,j,k);
+				at[n] = index(i,j,k);
+				if(++n == BlockSize || (i+1 == hi[0] && j+1 == hi[1] && k+1 == hi[2])) {
+					program.evalBlock(xs, values, n);
+					for(size_t s=0;s<n;++s) data[at[s]] = Codec::encode(values[s], scale, offset);
+					n = 0;
+				}
+			}
+		});
+		fillHalo();
+	}
+
+	//! Fit the range to a full-precision bake, halo included, then encode
+	//! the lattice tile by tile
+	void bakeQuantized(typename ConstructFieldNode<T>::ptr source) {
+		ConstructGrid<T> exact(domain, outside_field, halo, rule, layout);
+		exact.bakeData(source);
+		const int* r = domain.res;
+		const T first = exact.gets(0,0,0);
+		real low = Scalars<T>::ptr(&first)[0], high = low;
+		#pragma omp parallel for reduction(min:low) reduction(max:high)
+		for(int k=-halo;k<r[2]+halo;++k)
+		for(int j=-halo;j<r[1]+halo;++j)
+		for(int i=-halo;i<r[0]+halo;++i) {
+			const T value = exact.gets(i,j,k);
+			const real* c = Scalars<T>::ptr(&value);
+			for(int a=0;a<Scalars<T>::Count;++a) { low = std::min(low, c[a]); high = std::max(high, c[a]); }
+		}
+		S::range(low, high, scale, offset);
+		forEachTile([&](const int* lo, const int* hi) {
+			for(int k=lo[2];k<hi[2];++k)
+			for(int j=lo[1];j<hi[1];++j)
+			for(int i=lo[0];i<hi[0];++i) data[index(i,j,k)] = Codec::encode(exact.data[exact.index(i,j,k)], scale, offset);
+		});
+		fillHalo();
+	}
+
 	T eval(const Vec3& x) const {
 		Vec3 relative = (x - domain.bmin).cwiseProduct(domain.Hinverse);
 
@@ -62,28 +335,219 @@ struct ConstructGrid : public ConstructFieldNode<T> {
 		int j = (int)floor(relative[1]);
 		int k = (int)floor(relative[2]);
 		
-		int i1 = i+1, j1 = j+1, k1 = k+1;
 		const Vec3 w = relative - Vec3(i,j,k);
-		const Vec3 w1 = Vec3(1,1,1) - w;
+		if(interpolation != InterpolateLinear) return tricubic(i, j, k, w[0], w[1], w[2]);
+		return trilinear(i, j, k, w[0], w[1], w[2]);
+	}
+
+	//! Trilinear blend over the cell with lower corner (i,j,k). Cells with
+	//! all eight corners stored read them at fixed strides from one base
+	//! index (for bricked grids, when the cell lies within one brick);
+	//! only cells reaching past the halo go through get(). Converted
+	//! storage decodes the eight corners together.
+	inline T trilinear(int i, int j, int k, real wx, real wy, real wz) const {
+		const int i1 = i+1, j1 = j+1, k1 = k+1;
+		if((unsigned)(i + halo) < (unsigned)(padded(0)-1) && 
+			 (unsigned)(j + halo) < (unsigned)(padded(1)-1) && 
+			 (unsigned)(k + halo) < (unsigned)(padded(2)-1)) {
+			if(layout == LayoutLinear)
+				return corners(data + index(i,j,k), padded(0), padded(0) * padded(1), wx, wy, wz);
+			if((i + halo) % Brick < Brick-1 && (j + halo) % Brick < Brick-1 && (k + halo) % Brick < Brick-1)
+				return corners(data + index(i,j,k), Brick, Brick * Brick, wx, wy, wz);
+			const T c[8] = { gets(i,j,k), gets(i1,j,k), gets(i,j1,k), gets(i1,j1,k),
+				gets(i,j,k1), gets(i1,j,k1), gets(i,j1,k1), gets(i1,j1,k1) };
+			return blend(c, 2, 4, wx, wy, wz);
+		}
+		const T c[8] = { get(i,j,k), get(i1,j,k), get(i,j1,k), get(i1,j1,k),
+			get(i,j,k1), get(i1,j,k1), get(i,j1,k1), get(i1,j1,k1) };
+		return blend(c, 2, 4, wx, wy, wz);
+	}
+
+	//! Blend of stored corners, as blend()
+	inline T corners(const T* c, int sy, int sz, real wx, real wy, real wz) const
+	{ return blend(c, sy, sz, wx, wy, wz); }
+	template<typename Q>
+	inline T corners(const Q* q, int sy, int sz, real wx, real wy, real wz) const {
+		const Q g[8] = { q[0], q[1], q[sy], q[sy+1], q[sz], q[sz+1], q[sz+sy], q[sz+sy+1] };
+		T c[8];
+		Codec::decode(g, c, 8, scale, offset);
+		return blend(c, 2, 4, wx, wy, wz);
+	}
 
+	//! Trilinear blend of the corners c[0], c[1], c[sy], c[sy+1], c[sz], ...
+	static inline T blend(const T* c, int sy, int sz, real wx, real wy, real wz) {
+		const real wx1 = 1-wx, wy1 = 1-wy, wz1 = 1-wz;
 		return
-			w1[0] * w1[1] * w1[2] * get(i ,j ,k ) +
-			w[0]  * w1[1] * w1[2] * get(i1,j ,k ) +
-			w1[0] * w[1]  * w1[2] * get(i ,j1,k ) +
-			w[0]  * w[1]  * w1[2] * get(i1,j1,k ) +
-			w1[0] * w1[1] * w[2]  * get(i ,j ,k1) +
-			w[0]  * w1[1] * w[2]  * get(i1,j ,k1) +
-			w1[0] * w[1]  * w[2]  * get(i ,j1,k1) +
-			w[0]  * w[1]  * w[2]  * get(i1,j1,k1);
+			wx1 * wy1 * wz1 * c[0] +
+			wx  * wy1 * wz1 * c[1] +
+			wx1 * wy  * wz1 * c[sy] +
+			wx  * wy  * wz1 * c[sy+1] +
+			wx1 * wy1 * wz  * c[sz] +
+			wx  * wy1 * wz  * c[sz+1] +
+			wx1 * wy  * wz  * c[sz+sy] +
+			wx  * wy  * wz  * c[sz+sy+1];
 	}
 
-	typename FieldInfo<T>::GradType grad(const Vec3& x) const {
-		throw std::logic_error("Gradient of Matrix Field not supported");
-		return FieldInfo<typename FieldInfo<T>::GradType>::Zero(); 
+	//! Catmull-Rom weights of the four samples around t in [0,1)
+	static inline void cubicWeights(real t, real* w) {
+		const real t2 = t * t, t3 = t2 * t;
+		w[0] = (real).5 * (2 * t2 - t - t3);
+		w[1] = (real).5 * (2 - 5 * t2 + 3 * t3);
+		w[2] = (real).5 * (t + 4 * t2 - 3 * t3);
+		w[3] = (real).5 * (t3 - t2);
 	}
 
-	//! Divergence-Free projection. Only specialized for vector fields 
-	void divFree(ScalarField boundary, int iterations) { }
+	//! Blend four consecutive runs of n values into one, over their flat
+	//! components so the loop vectorizes. The monotone mode clamps between
+	//! the middle two runs.
+	static inline void cubicPass(const T* in, T* out, int n, const real* w, bool monotone) {
+		const int N = n * Scalars<T>::Count;
+		const real* a = Scalars<T>::ptr(in);
+		real* b = Scalars<T>::ptr(out);
+		for(int e=0;e<N;++e) 
+			b[e] = w[0] * a[e] + w[1] * a[N+e] + w[2] * a[2*N+e] + w[3] * a[3*N+e];
+		if(monotone)
+			for(int e=0;e<N;++e) 
+				b[e] = std::min(std::max(b[e], std::min(a[N+e], a[2*N+e])), std::max(a[N+e], a[2*N+e]));
+	}
+
+	//! The 4x4x4 values from lattice point (i,j,k) up, x fastest. Rows
+	//! stored contiguously are decoded four values at a time.
+	inline void gather4(int i, int j, int k, T* c) const {
+		if(stored(i,j,k) && stored(i+3,j+3,k+3)) {
+			if(layout == LayoutLinear || (i + halo) % Brick <= Brick-4) {
+				for(int z=0;z<4;++z)
+				for(int y=0;y<4;++y) Codec::decode(data + index(i,j+y,k+z), c + (z*4+y)*4, 4, scale, offset);
+				return;
+			}
+			for(int z=0;z<4;++z)
+			for(int y=0;y<4;++y)
+			for(int x=0;x<4;++x) c[(z*4+y)*4+x] = gets(i+x,j+y,k+z);
+			return;
+		}
+		for(int z=0;z<4;++z)
+		for(int y=0;y<4;++y)
+		for(int x=0;x<4;++x) c[(z*4+y)*4+x] = get(i+x,j+y,k+z);
+	}
+
+	//! Tricubic interpolation in the cell with lower corner (i,j,k), from
+	//! its 4x4x4 neighborhood with separable weights: z blends four
+	//! planes of 16 values, then y four rows, then x the last four values.
+	inline T tricubic(int i, int j, int k, real wx, real wy, real wz) const {
+		const bool monotone = interpolation == InterpolateMonotone;
+		T c[64], r[16], q[4], v;
+		real w[4];
+		gather4(i-1, j-1, k-1, c);
+		cubicWeights(wz, w); cubicPass(c, r, 16, w, monotone);
+		cubicWeights(wy, w); cubicPass(r, q, 4, w, monotone);
+		cubicWeights(wx, w); cubicPass(q, &v, 1, w, monotone);
+		return v;
+	}
+
+	//! The eight corners of the cell with lower corner (i,j,k), x fastest
+	inline void gather2(int i, int j, int k, T* c) const {
+		if(stored(i,j,k) && stored(i+1,j+1,k+1)) {
+			if(layout == LayoutLinear || ((i + halo) % Brick < Brick-1 && (j + halo) % Brick < Brick-1 && (k + halo) % Brick < Brick-1)) {
+				const int sy = layout == LayoutLinear ? padded(0) : Brick, sz = layout == LayoutLinear ? padded(0) * padded(1) : Brick * Brick;
+				const Stored* q = data + index(i,j,k);
+				const int at[8] = { 0, 1, sy, sy+1, sz, sz+1, sz+sy, sz+sy+1 };
+				for(int n=0;n<8;++n) c[n] = Codec::decode(q[at[n]], scale, offset);
+				return;
+			}
+			for(int n=0;n<8;++n) c[n] = gets(i + (n & 1), j + (n >> 1 & 1), k + (n >> 2));
+			return;
+		}
+		for(int n=0;n<8;++n) c[n] = get(i + (n & 1), j + (n >> 1 & 1), k + (n >> 2));
+	}
+
+	//! Trilinear value, with its derivatives along each axis (per cell) in d
+	inline T trilinearWithGrad(int i, int j, int k, real wx, real wy, real wz, T* d) const {
+		T c[8];
+		gather2(i, j, k, c);
+		const real wx1 = 1-wx, wy1 = 1-wy, wz1 = 1-wz;
+		d[0] = wy1 * wz1 * (c[1] - c[0]) + wy * wz1 * (c[3] - c[2]) + wy1 * wz * (c[5] - c[4]) + wy * wz * (c[7] - c[6]);
+		d[1] = wx1 * wz1 * (c[2] - c[0]) + wx * wz1 * (c[3] - c[1]) + wx1 * wz * (c[6] - c[4]) + wx * wz * (c[7] - c[5]);
+		d[2] = wx1 * wy1 * (c[4] - c[0]) + wx * wy1 * (c[5] - c[1]) + wx1 * wy * (c[6] - c[2]) + wx * wy * (c[7] - c[3]);
+		return blend(c, 2, 4, wx, wy, wz);
+	}
+
+	//! Derivatives of the Catmull-Rom weights
+	static inline void cubicDerivatives(real t, real* w) {
+		const real t2 = t * t;
+		w[0] = (real).5 * (4 * t - 1 - 3 * t2);
+		w[1] = (real).5 * (9 * t2 - 10 * t);
+		w[2] = (real).5 * (1 + 8 * t - 9 * t2);
+		w[3] = (real).5 * (3 * t2 - 2 * t);
+	}
+
+	//! Tricubic value, with its derivatives along each axis (per cell) in
+	//! d. The derivative passes run alongside the value passes.
+	inline T tricubicWithGrad(int i, int j, int k, real wx, real wy, real wz, T* d) const {
+		const bool monotone = interpolation == InterpolateMonotone;
+		T c[64], r[16], rz[16], q[4], qy[4], qz[4], v;
+		real w[4], dw[4];
+		gather4(i-1, j-1, k-1, c);
+		cubicWeights(wz, w); cubicDerivatives(wz, dw);
+		cubicPass(c, r, 16, w, monotone); cubicPass(c, rz, 16, dw, false);
+		cubicWeights(wy, w); cubicDerivatives(wy, dw);
+		cubicPass(r, q, 4, w, monotone); cubicPass(r, qy, 4, dw, false); cubicPass(rz, qz, 4, w, false);
+		cubicWeights(wx, w); cubicDerivatives(wx, dw);
+		cubicPass(q, &v, 1, w, monotone); cubicPass(q, d, 1, dw, false); 
+		cubicPass(qy, d+1, 1, w, false); cubicPass(qz, d+2, 1, w, false);
+		return v;
+	}
+
+	//! Sampling of n points. Cell indices and weights are computed with
+	//! SIMD over the x/y/z components of the block.
+	void evalBlock(const Vec3* xs, T* out, size_t n) const {
+		SoABlock cell, w;
+		simd::lattice(xs, domain.bmin, domain.Hinverse, cell, w, n);
+
+		if(interpolation != InterpolateLinear) {
+			for(size_t s=0;s<n;++s)
+				out[s] = tricubic((int)cell.x[s], (int)cell.y[s], (int)cell.z[s], w.x[s], w.y[s], w.z[s]);
+			return;
+		}
+		for(size_t s=0;s<n;++s)
+			out[s] = trilinear((int)cell.x[s], (int)cell.y[s], (int)cell.z[s], w.x[s], w.y[s], w.z[s]);
+	}
+
+	//! Compiled programs sample the grid without going through the vtable
+	static void sampleBlock(const void* grid, const Vec3* xs, void* out, size_t n)
+	{ static_cast<const ConstructGrid*>(grid)->ConstructGrid::evalBlock(xs, static_cast<T*>(out), n); }
+	int compile(FieldCompiler& c, int x) const
+	{ return c.leaf<T>(Register<T>::Sample, this, &sampleBlock, x); }
+
+	//! Value and gradient in one cell walk, from the derivatives of the
+	//! interpolation basis. The gradient of monotone grids ignores the
+	//! clamping.
+	ValueAndGrad<T> evalWithGrad(const Vec3& x) const {
+		Vec3 relative = (x - domain.bmin).cwiseProduct(domain.Hinverse);
+		const int i = (int)floor(relative[0]), j = (int)floor(relative[1]), k = (int)floor(relative[2]);
+		const Vec3 w = relative - Vec3(i,j,k);
+		T d[3];
+		const T value = interpolation == InterpolateLinear ? 
+			trilinearWithGrad(i, j, k, w[0], w[1], w[2], d) : tricubicWithGrad(i, j, k, w[0], w[1], w[2], d);
+		for(int a=0;a<3;++a) d[a] *= domain.Hinverse[a];
+		return ValueAndGrad<T>(value, GridGradient<T>::of(d));
+	}
+
+	typename FieldInfo<T>::GradType grad(const Vec3& x) const
+	{ return evalWithGrad(x).grad; }
+
+	real spacing() const { return domain.H.minCoeff(); }
+
+	//! Divergence-Free projection. Only specialized for full-precision
+	//! vector grids; other grids throw.
+	SolverStats divFree(ScalarField boundary, const ConvergencePolicy& policy, GridWorkspace& workspace, PoissonSolver solver = SolverCG) 
+	{ throw std::logic_error("Divergence-free projection needs a full-precision vector grid."); }
+	SolverStats divFree(ScalarField boundary, const ConvergencePolicy& policy);
+	//! Solving into pressure, a grid on this domain kept by the caller
+	//! from step to step: each solve starts from the last one's solution
+	//! (the first from 0, as new grids read 0).
+	SolverStats divFree(ScalarField boundary, const ConvergencePolicy& policy, GridWorkspace& workspace, ConstructGrid<real>& pressure,
+		PoissonSolver solver = SolverCG) 
+	{ throw std::logic_error("Divergence-free projection needs a full-precision vector grid."); }
  
 	//! Load a gridded field from disk 
 	void load(const char* path) { 
@@ -94,66 +558,82 @@ struct ConstructGrid : public ConstructFieldNode<T> {
     if(1 != fread(&newdomain.bmin, sizeof(Vec3), 1, f)) { }
     if(1 != fread(&newdomain.bmax, sizeof(Vec3), 1, f)) { }
 	
-		domain = newdomain;
-    const unsigned int N = domain.res[0] * domain.res[1] * domain.res[2];
-    delete[] data;
-    data = NULL;
-    data = new T[N];
-    if(N != fread(data, sizeof(T), N, f)) { }
+		BufferPool<Stored>::release(data, size());
+		// Rebuilt for the cell sizes, which positions in the halo need
+		domain = Domain(newdomain.res[0], newdomain.res[1], newdomain.res[2], newdomain.bmin, newdomain.bmax);
+    bool fresh;
+    data = BufferPool<Stored>::acquire(size(), &fresh);
+    if(fresh) firstTouch();
+    // Files hold the full-precision lattice only, in row order
+    const size_t N = (size_t)domain.res[0] * domain.res[1] * domain.res[2];
+    std::vector<T> values(N);
+    if(N != fread(&values[0], sizeof(T), N, f)) { }
     fclose(f);
+    fitRange(&values[0], N);
+    size_t v = 0;
+    for(int k=0;k<domain.res[2];++k)
+    for(int j=0;j<domain.res[1];++j)
+    for(int i=0;i<domain.res[0];++i) set(i,j,k, values[v++]);
+    fillHalo();
   }
 
 	//! Save a gridded field to disk
   void save(const char* path) {
     FILE *f = fopen(path, "wb");
-    int N = domain.res[0] * domain.res[1] * domain.res[2];
     fwrite(domain.res, 3, sizeof(int), f);
     fwrite(&domain.bmin, 1, sizeof(Vec3), f);
     fwrite(&domain.bmax, 1, sizeof(Vec3), f);
-    fwrite(data, N, sizeof(T), f);
+    std::vector<T> row(domain.res[0]);
+    for(int k=0;k<domain.res[2];++k)
+    for(int j=0;j<domain.res[1];++j) {
+      for(int i=0;i<domain.res[0];++i) row[i] = gets(i,j,k);
+      fwrite(&row[0], domain.res[0], sizeof(T), f);
+    }
     fclose(f);
   }
 };
 
 // Grid gradient operators
-template<> Vec3 ConstructGrid<real>::grad(const Vec3& x) const
-{ 
-	const Vec3 &dx(domain.H);
-	Vec3 result;
-	result[0] = (eval(x + Vec3(dx[0],0,0)) - eval(x - Vec3(dx[0],0,0))) / (2 * dx[0]);
-	result[1] = (eval(x + Vec3(0,dx[1],0)) - eval(x - Vec3(0,dx[1],0))) / (2 * dx[1]);
-	result[2] = (eval(x + Vec3(0,0,dx[2])) - eval(x - Vec3(0,0,dx[2]))) / (2 * dx[2]);
-	return result;
-}
+template<> struct GridGradient<real> {
+	static Vec3 of(const real* d) { return Vec3(d[0], d[1], d[2]); }
+};
 
-template<> Mat3 ConstructGrid<Vec3>::grad(const Vec3& x) const
-{ 
-	const Vec3 &dx(domain.H);
-  Vec3 D;
-	Mat3 result;
-	D = (eval(x + Vec3(dx[0],0,0)) - eval(x - Vec3(dx[0],0,0))) / (2 * dx[0]);
-  result(0,0) = D[0]; result(0,1) = D[1]; result(0,2) = D[2];
-  D = (eval(x + Vec3(0,dx[1],0)) - eval(x - Vec3(0,dx[1],0))) / (2 * dx[1]);
-	result(1,0) = D[0]; result(1,1) = D[1]; result(1,2) = D[2];
-  D = (eval(x + Vec3(0,0,dx[2])) - eval(x - Vec3(0,0,dx[2]))) / (2 * dx[2]);
-	result(2,0) = D[0]; result(2,1) = D[1]; result(2,2) = D[2];
-	return result;
-}
+//! Row a holds the derivative along axis a
+template<> struct GridGradient<Vec3> {
+	static Mat3 of(const Vec3* d) { 
+		Mat3 result;
+		for(int a=0;a<3;++a) { result(a,0) = d[a][0]; result(a,1) = d[a][1]; result(a,2) = d[a][2]; }
+		return result;
+	}
+};
 
-#include <iostream>
-// Divergence-Free Projection
-// Use Helmholtz-Hodge decomposition to compute div-free component of a vector field
-template<> void ConstructGrid<Vec3>::divFree(ScalarField boundary, int iterations) {
-	ConstructGrid<real> p(domain, constant(static_cast<real>(0)).node);
-	ConstructGrid<real> divergence(domain, constant(static_cast<real>(0)).node);
-	p.bakeData(ScalarField(static_cast<real>(0)).node);
+//! Scratch grids for solvers, kept from call to call so that repeated
+//! solves on one domain allocate nothing. Each slot is made on first use,
+//! and remade when asked for on another domain.
+struct GridWorkspace {
+	std::vector<std::unique_ptr<ConstructGrid<real> > > grids;
 
-  ConstructGrid<real> r(domain, constant(static_cast<real>(0)).node);
-  ConstructGrid<real> d(domain, constant(static_cast<real>(0)).node);
-  ConstructGrid<real> q(domain, constant(static_cast<real>(0)).node);
-  ConstructGrid<real> skip(domain, constant(static_cast<real>(1)).node);
+	//! Scratch grid number slot on domain d. It reads 0 outside, and holds
+	//! whatever its last user left in it.
+	ConstructGrid<real>& grid(size_t slot, const Domain& d) {
+		if(slot >= grids.size()) grids.resize(slot+1);
+		const ConstructGrid<real>* g = grids[slot].get();
+		if(!g || !g->domain.sameLattice(d))
+			grids[slot].reset(new ConstructGrid<real>(d, constant(static_cast<real>(0)).node));
+		return *grids[slot];
+	}
+};
+
+template<typename T, typename S>
+SolverStats ConstructGrid<T,S>::divFree(ScalarField boundary, const ConvergencePolicy& policy) {
+	GridWorkspace workspace;
+	return divFree(boundary, policy, workspace);
+}
 
-  // Outside "skip" area
+//! Mark solid cells in skip: the lattice border, and wherever boundary
+//! is positive. Others, the fluid cells, are set to 0.
+inline void solidCells(ConstructGrid<real>& skip, ScalarField boundary) {
+  const Domain& domain = skip.domain;
 #pragma omp parallel for
   for(int i=0;i<domain.res[0];++i)
   for(int j=0;j<domain.res[1];++j)
@@ -167,147 +647,533 @@ template<> void ConstructGrid<Vec3>::divFree(ScalarField boundary, int iteration
     if(boundary.eval(domain.position(i,j,k)) > 0)
       skip.set(i,j,k,1);
   }
+}
 
-  // TODO: Generalize this for other boundaries and conditions (Dirichlet, etc)
-	// Set no flux for velocity
-#pragma omp parallel for
-    for(int k=0;k<domain.res[2];++k) 
-    for(int j=0;j<domain.res[1];++j)
-    for(int i=0;i<domain.res[0];++i) {
-      if(i==0 || i==domain.res[0]-1) set(i,j,k, gets(i,j,k).cwiseProduct(Vec3(0,1,1)));
-      if(j==0 || j==domain.res[1]-1) set(i,j,k, gets(i,j,k).cwiseProduct(Vec3(1,0,1)));
-      if(k==0 || k==domain.res[2]-1) set(i,j,k, gets(i,j,k).cwiseProduct(Vec3(1,1,0)));
-    }
+//////////////////////////////////////////////////////////
+// Geometric multigrid for the pressure Poisson problem. Each level has
+// half the cells of the one above along every axis; a coarse cell is
+// fluid when any of its (up to 8) children is. Operators are rebuilt
+// from the mask on every level, with no flux into solid cells or out of
+// the lattice.
+namespace multigrid {
 
-	// Compute divergence of non-boundary cells
-#pragma omp parallel for
-    for(int k=1;k<domain.res[2]-1;++k) 
-    for(int j=1;j<domain.res[1]-1;++j)
-    for(int i=1;i<domain.res[0]-1;++i) {
-      real D = gets(i+1,j,k)[0] + gets(i,j+1,k)[1] + gets(i,j,k+1)[2];
-			D -= gets(i-1,j,k)[0] + gets(i,j-1,k)[1] + gets(i,j,k-1)[2];
-			D *= .5f;
-      divergence.set(i,j,k, D ); // ASSUMED CUBIC CELLS!
-    }
+enum { PreSmooth = 2, PostSmooth = 2, CoarsestSweeps = 40, CoarsestRes = 4 };
 
-    // Conjugate Gradient 
-    // (http://en.wikipedia.org/wiki/Conjugate_gradient_method)
-    // r = b - Ax
-#pragma omp parallel for
-    for(int k=1;k<domain.res[2]-1;++k) 
-    for(int j=1;j<domain.res[1]-1;++j) 
-    for(int i=1;i<domain.res[0]-1;++i) {
-      real center = 0., R = 0.;
-      if(skip.get(i-1,j,k)!=1) { center += 1; R += p.gets(i-1,j,k); }
-      if(skip.get(i,j-1,k)!=1) { center += 1; R += p.gets(i,j-1,k); }
-      if(skip.get(i,j,k-1)!=1) { center += 1; R += p.gets(i,j,k-1); }
-      if(skip.get(i+1,j,k)!=1) { center += 1; R += p.gets(i+1,j,k); }
-      if(skip.get(i,j+1,k)!=1) { center += 1; R += p.gets(i,j+1,k); }
-      if(skip.get(i,j,k+1)!=1) { center += 1; R += p.gets(i,j,k+1); }
-      
-      R = -divergence.gets(i,j,k) - (center * p.gets(i,j,k) - R);
-      r.set(i,j,k, skip.get(i,j,k)==1 ? 0. : R);
-    }
+inline bool fluid(const ConstructGrid<real>& skip, int i, int j, int k)
+{ return skip.domain.inside(i,j,k) && skip.gets(i,j,k) != 1; }
 
-    // d = r
-#pragma omp parallel for
-    for(int k=1;k<domain.res[2]-1;++k) 
-    for(int j=1;j<domain.res[1]-1;++j)
-    for(int i=1;i<domain.res[0]-1;++i) {
-      d.set(i,j,k, r.gets(i,j,k) );
-    }
+//! Number of fluid neighbors of cell (i,j,k), and the sum of x over them.
+//! Only cells on the border of the lattice need their neighbors checked
+//! for being on it.
+template<bool Border>
+inline real neighbors(const ConstructGrid<real>& x, const ConstructGrid<real>& skip, int i, int j, int k, real& sum) {
+	real count = 0;
+	sum = 0;
+	const int n[6][3] = { {i-1,j,k}, {i+1,j,k}, {i,j-1,k}, {i,j+1,k}, {i,j,k-1}, {i,j,k+1} };
+	for(int a=0;a<6;++a)
+		if(Border ? fluid(skip, n[a][0], n[a][1], n[a][2]) : skip.gets(n[a][0], n[a][1], n[a][2]) != 1)
+		{ count += 1; sum += x.gets(n[a][0], n[a][1], n[a][2]); }
+	return count;
+}
 
-    // deltaNew = transpose(r) * r
-    real deltaNew = 0.;
-#pragma omp parallel for reduction(+:deltaNew)
-    for(int k=1;k<domain.res[2]-1;++k)
-    for(int j=1;j<domain.res[1]-1;++j)
-    for(int i=1;i<domain.res[0]-1;++i) {
-      deltaNew += r.gets(i,j,k) * r.gets(i,j,k);
-    }
+inline real neighbors(const ConstructGrid<real>& x, const ConstructGrid<real>& skip, int i, int j, int k, real& sum) {
+	const int* r = x.domain.res;
+	if(i == 0 || j == 0 || k == 0 || i == r[0]-1 || j == r[1]-1 || k == r[2]-1) return neighbors<true>(x, skip, i, j, k, sum);
+	return neighbors<false>(x, skip, i, j, k, sum);
+}
 
-    // delta = deltaNew
-    const real eps = 1.e-4;
-    real maxR = 1.f;
-    int iter=0;
-    while((iter<iterations) && (maxR > eps)) {
-      // q = A d
-#pragma omp parallel for
-      for(int k=1;k<domain.res[2]-1;++k) 
-      for(int j=1;j<domain.res[1]-1;++j)
-      for(int i=1;i<domain.res[0]-1;++i) {
-        real center = 0., R = 0.;
-        if(skip.get(i-1,j,k)!=1) { center += 1; R += d.gets(i-1,j,k); }
-        if(skip.get(i,j-1,k)!=1) { center += 1; R += d.gets(i,j-1,k); }
-        if(skip.get(i,j,k-1)!=1) { center += 1; R += d.gets(i,j,k-1); }
-        if(skip.get(i+1,j,k)!=1) { center += 1; R += d.gets(i+1,j,k); }
-        if(skip.get(i,j+1,k)!=1) { center += 1; R += d.gets(i,j+1,k); }
-        if(skip.get(i,j,k+1)!=1) { center += 1; R += d.gets(i,j,k+1); }
-        
-        R = (center * d.gets(i,j,k) - R);
-        q.set(i,j,k, skip.get(i,j,k)==1 ? 0. : R);
-      }
+//! Red-black Gauss-Seidel sweeps of count * x - sum = b, black first
+//! when reversed
+inline void smooth(ConstructGrid<real>& x, const ConstructGrid<real>& b, const ConstructGrid<real>& skip, int sweeps, bool reverse = false) {
+	const int* r = x.domain.res;
+	for(int s=0;s<sweeps;++s)
+	for(int c=0;c<2;++c) {
+		const int color = reverse ? 1 - c : c;
+		#pragma omp parallel for
+		for(int k=0;k<r[2];++k)
+		for(int j=0;j<r[1];++j)
+		for(int i=(color + j + k) & 1;i<r[0];i+=2) {
+			if(skip.gets(i,j,k) == 1) continue;
+			real sum;
+			const real count = neighbors(x, skip, i, j, k, sum);
+			if(count > 0) x.set(i,j,k, (b.gets(i,j,k) + sum) / count);
+		}
+	}
+}
 
-      // alpha = deltaNew / (d'q)
-      real alpha = 0.f;
-#pragma omp parallel for reduction(+:alpha)      
-      for(int k=1;k<domain.res[2]-1;++k)
-      for(int j=1;j<domain.res[1]-1;++j)
-      for(int i=1;i<domain.res[0]-1;++i)
-      {  alpha += d.gets(i,j,k) * q.gets(i,j,k); }
+//! res = b - A x on fluid cells, 0 on solid ones. Returns the largest
+//! magnitude, and the sum of squares into squares if given.
+inline real residual(const ConstructGrid<real>& x, const ConstructGrid<real>& b, const ConstructGrid<real>& skip, ConstructGrid<real>& res,
+	real* squares = NULL) {
+	const int* r = x.domain.res;
+	real largest = 0, sum = 0;
+	#pragma omp parallel for reduction(max:largest) reduction(+:sum)
+	for(int k=0;k<r[2];++k)
+	for(int j=0;j<r[1];++j)
+	for(int i=0;i<r[0];++i) {
+		real R = 0;
+		if(skip.gets(i,j,k) != 1) {
+			real sum;
+			const real count = neighbors(x, skip, i, j, k, sum);
+			R = b.gets(i,j,k) - (count * x.gets(i,j,k) - sum);
+		}
+		res.set(i,j,k, R);
+		largest = std::max(largest, std::fabs(R));
+		sum += R * R;
+	}
+	if(squares) *squares = sum;
+	return largest;
+}
+
+//! The mean of x over fluid cells (0 if there are none). Summed in
+//! double: any error is a constant left in a right-hand side, which the
+//! solvers cannot remove and preconditioners amplify.
+inline real fluidMean(const ConstructGrid<real>& x, const ConstructGrid<real>& skip) {
+	const int* r = x.domain.res;
+	double total = 0, cells = 0;
+	#pragma omp parallel for reduction(+:total,cells)
+	for(int k=0;k<r[2];++k)
+	for(int j=0;j<r[1];++j)
+	for(int i=0;i<r[0];++i)
+		if(skip.gets(i,j,k) != 1) { total += x.gets(i,j,k); cells += 1; }
+	return cells == 0 ? 0 : (real)(total / cells);
+}
 
-      if(fabs(alpha) > .0) 
-        alpha = deltaNew / alpha;
+//! Subtract the mean over fluid cells from x, projecting out the
+//! constant null space of the (all-Neumann) operator
+inline void removeMean(ConstructGrid<real>& x, const ConstructGrid<real>& skip) {
+	const int* r = x.domain.res;
+	const real mean = fluidMean(x, skip);
+	if(mean == 0) return;
+	#pragma omp parallel for
+	for(int k=0;k<r[2];++k)
+	for(int j=0;j<r[1];++j)
+	for(int i=0;i<r[0];++i)
+		if(skip.gets(i,j,k) != 1) x.set(i,j,k, x.gets(i,j,k) - mean);
+}
 
-      // x = x + alpha * d
-#pragma omp parallel for
-      for(int k=1;k<domain.res[2]-1;++k) 
-      for(int j=1;j<domain.res[1]-1;++j)
-      for(int i=1;i<domain.res[0]-1;++i) {
-				p.set(i,j,k, p.gets(i,j,k) + alpha * d.gets(i,j,k)); 
-        r.set(i,j,k, r.gets(i,j,k) - alpha * q.gets(i,j,k)); 
+//! The coarse mask: fluid where any child is
+inline void coarsenMask(const ConstructGrid<real>& fine, ConstructGrid<real>& coarse) {
+	const int* r = coarse.domain.res;
+	#pragma omp parallel for
+	for(int k=0;k<r[2];++k)
+	for(int j=0;j<r[1];++j)
+	for(int i=0;i<r[0];++i) {
+		real solid = 1;
+		for(int c=0;c<8;++c)
+			if(fluid(fine, 2*i + (c & 1), 2*j + (c >> 1 & 1), 2*k + (c >> 2))) solid = 0;
+		coarse.set(i,j,k, solid);
+	}
+}
+
+//! Coarse right-hand side from the fine residual. Halving the sum over
+//! the children averages them and scales for the doubled cell size.
+inline void restrictResidual(const ConstructGrid<real>& res, const ConstructGrid<real>& fineSkip, ConstructGrid<real>& b) {
+	const int* r = b.domain.res;
+	#pragma omp parallel for
+	for(int k=0;k<r[2];++k)
+	for(int j=0;j<r[1];++j)
+	for(int i=0;i<r[0];++i) {
+		real sum = 0;
+		for(int c=0;c<8;++c) {
+			const int fi = 2*i + (c & 1), fj = 2*j + (c >> 1 & 1), fk = 2*k + (c >> 2);
+			if(fluid(fineSkip, fi, fj, fk)) sum += res.gets(fi,fj,fk);
+		}
+		b.set(i,j,k, sum * (real).5);
+	}
+}
+
+//! Add the coarse correction to the fluid cells it covers
+inline void prolongate(const ConstructGrid<real>& e, ConstructGrid<real>& x, const ConstructGrid<real>& skip) {
+	const int* r = x.domain.res;
+	#pragma omp parallel for
+	for(int k=0;k<r[2];++k)
+	for(int j=0;j<r[1];++j)
+	for(int i=0;i<r[0];++i)
+		if(skip.gets(i,j,k) != 1) x.set(i,j,k, x.gets(i,j,k) + e.gets(i/2,j/2,k/2));
+}
+
+//! The domain of the next coarser level
+inline Domain coarsen(const Domain& d) {
+	const int r[3] = { (d.res[0] + 1) / 2, (d.res[1] + 1) / 2, (d.res[2] + 1) / 2 };
+	return Domain(r[0], r[1], r[2], d.bmin, d.bmin + Vec3(r[0]-1, r[1]-1, r[2]-1).cwiseProduct(2 * d.H));
+}
+
+//! Grids of one level: solution, right-hand side, residual and mask
+struct Level { ConstructGrid<real> *x, *b, *res, *skip; };
+
+//! The levels below top, down to CoarsestRes, from workspace slots 9 and
+//! up
+inline std::vector<Level> hierarchy(const Level& top, GridWorkspace& workspace) {
+	std::vector<Level> levels(1, top);
+	Domain d = top.x->domain;
+	while(std::min(std::min(d.res[0], d.res[1]), d.res[2]) > CoarsestRes) {
+		d = coarsen(d);
+		const size_t slot = 9 + 4 * (levels.size() - 1);
+		Level L = { &workspace.grid(slot, d), &workspace.grid(slot+1, d), &workspace.grid(slot+2, d), &workspace.grid(slot+3, d) };
+		coarsenMask(*levels.back().skip, *L.skip);
+		levels.push_back(L);
+	}
+	return levels;
+}
+
+//! Post-smoothing mirrors pre-smoothing, so that a cycle from x = 0 is a
+//! symmetric operator, as a CG preconditioner must be. The coarsest
+//! solve works in the complement of the null space; there the mean of b
+//! would otherwise grow the mean of x without bound.
+inline void vcycle(std::vector<Level>& levels, size_t l) {
+	Level& L = levels[l];
+	if(l + 1 == levels.size()) {
+		removeMean(*L.b, *L.skip);
+		smooth(*L.x, *L.b, *L.skip, CoarsestSweeps / 2);
+		smooth(*L.x, *L.b, *L.skip, CoarsestSweeps / 2, true);
+		removeMean(*L.x, *L.skip);
+		return;
+	}
+	Level& C = levels[l+1];
+	smooth(*L.x, *L.b, *L.skip, PreSmooth);
+	residual(*L.x, *L.b, *L.skip, *L.res);
+	restrictResidual(*L.res, *L.skip, *C.b);
+	C.x->fill(0);
+	vcycle(levels, l+1);
+	prolongate(*C.x, *L.x, *L.skip);
+	smooth(*L.x, *L.b, *L.skip, PostSmooth, true);
+}
+
+//! Solves as solvePressure, by up to policy.iterations V-cycles. Level 0
+//! uses p, skip and workspace slots 2 and 6.
+inline SolverStats solve(ConstructGrid<real>& p, const ConstructGrid<real>& divergence, const ConstructGrid<real>& skip,
+	const ConvergencePolicy& policy, GridWorkspace& workspace) {
+	Level top = { &p, &workspace.grid(6, p.domain), &workspace.grid(2, p.domain), const_cast<ConstructGrid<real>*>(&skip) };
+	std::vector<Level> levels = hierarchy(top, workspace);
+
+	// The right-hand side of count * p - sum = -divergence. With no fixed
+	// cells the system is singular, and only solvable with a mean-free
+	// right-hand side: the one CG solves, so residuals compare.
+	const int* r = p.domain.res;
+	const real mean = fluidMean(divergence, skip);
+	#pragma omp parallel for
+	for(int k=0;k<r[2];++k)
+	for(int j=0;j<r[1];++j)
+	for(int i=0;i<r[0];++i) top.b->set(i,j,k, skip.gets(i,j,k) == 1 ? 0 : mean - divergence.gets(i,j,k));
+
+	// Stop when converged, or once a cycle no longer halves the residual
+	// (it has reached the precision of real)
+	SolverStats stats;
+	real squares;
+	real largest = residual(p, *top.b, skip, *top.res, &squares);
+	stats.initialResidual = stats.residual = policy.measure(largest, squares);
+	stats.converged = policy.converged(stats.residual, stats.initialResidual);
+	while(!stats.converged && stats.iterations < policy.iterations) {
+		vcycle(levels, 0);
+		const real last = stats.residual;
+		largest = residual(p, *top.b, skip, *top.res, &squares);
+		stats.residual = policy.measure(largest, squares);
+		stats.converged = policy.converged(stats.residual, stats.initialResidual);
+		if(stats.iterations++ > 0 && stats.residual > last * (real).5) break;
+	}
+	return stats;
+}
+
+//! One V-cycle from z = 0 towards A z = r, as a preconditioner. A lone
+//! level is also the coarsest, whose solve removes the mean of its
+//! right-hand side in place; it gets a copy of r (in slot 9) to work on.
+struct Preconditioner {
+	std::vector<Level> levels;
+	const ConstructGrid<real>* r;
+	Preconditioner(ConstructGrid<real>& z, ConstructGrid<real>& r, const ConstructGrid<real>& skip, GridWorkspace& workspace) : r(&r) {
+		Level top = { &z, &r, &workspace.grid(6, z.domain), const_cast<ConstructGrid<real>*>(&skip) };
+		levels = hierarchy(top, workspace);
+		if(levels.size() == 1) levels[0].b = &workspace.grid(9, z.domain);
+	}
+	void apply() {
+		ConstructGrid<real>& b = *levels[0].b;
+		if(&b != r) b.forEachTile([&](const int* lo, const int* hi) {
+			for(int k=lo[2];k<hi[2];++k)
+			for(int j=lo[1];j<hi[1];++j)
+			for(int i=lo[0];i<hi[0];++i) b.set(i,j,k, r->gets(i,j,k));
+		});
+		levels[0].x->fill(0);
+		vcycle(levels, 0);
+	}
+};
+
+};
+
+//////////////////////////////////////////////////////////
+// Modified incomplete Cholesky, MIC(0), of the pressure matrix: the
+// factor keeps the sparsity of the 7-point stencil, and the fill it drops
+// is mostly added back to the diagonal (Bridson, "Fluid Simulation for
+// Computer Graphics"). Each cell of the factorization and of the
+// triangular solves depends only on its lower (upper) neighbors, so rows
+// along x are done in wavefronts j+k = s, the rows of one in parallel.
+namespace mic {
+
+const real Tuning = .97f, Safety = .25f;
+
+//! Calls row(j,k) for the interior rows along x of d, each after the
+//! rows below it in j and k (after those above, when reversed). Rows
+//! themselves run through i upwards (downwards).
+template<typename F>
+inline void wavefronts(const Domain& d, bool reverse, const F& row) {
+	const int* r = d.res;
+	const int fronts = (r[1]-2) + (r[2]-2) - 1;
+	for(int n=0;n<fronts;++n) {
+		const int s = 2 + (reverse ? fronts - 1 - n : n);
+		#pragma omp parallel for
+		for(int k=std::max(1, s - (r[1]-2));k<std::min(r[2]-1, s);++k) row(s - k, k);
+	}
+}
+
+//! The inverse diagonal of the factor, into precon (0 on solid cells)
+inline void factor(const ConstructGrid<real>& skip, ConstructGrid<real>& precon) {
+	precon.fill(0);
+	const int last = skip.domain.res[0] - 1;
+	wavefronts(skip.domain, false, [&](int j, int k) {
+		real before = 0;  // precon of (i-1,j,k)
+		for(int i=1;i<last;++i) {
+			if(skip.gets(i,j,k) == 1) { before = 0; continue; }
+			real diagonal = 0, e = 0;
+
+			// For each lower fluid neighbor: its own entry, and the fill its
+			// other upper neighbors would have made
+			const bool up[3] = { skip.gets(i+1,j,k) != 1, skip.gets(i,j+1,k) != 1, skip.gets(i,j,k+1) != 1 };
+			const bool down[3] = { skip.gets(i-1,j,k) != 1, skip.gets(i,j-1,k) != 1, skip.gets(i,j,k-1) != 1 };
+			for(int a=0;a<3;++a) diagonal += up[a] + down[a];
+			if(down[0]) {
+				const real fill = (skip.gets(i-1,j+1,k) != 1) + (skip.gets(i-1,j,k+1) != 1);
+				e -= before * before * (1 + Tuning * fill);
+			}
+			if(down[1]) {
+				const real pn = precon.gets(i,j-1,k);
+				const real fill = (skip.gets(i+1,j-1,k) != 1) + (skip.gets(i,j-1,k+1) != 1);
+				e -= pn * pn * (1 + Tuning * fill);
+			}
+			if(down[2]) {
+				const real pn = precon.gets(i,j,k-1);
+				const real fill = (skip.gets(i+1,j,k-1) != 1) + (skip.gets(i,j+1,k-1) != 1);
+				e -= pn * pn * (1 + Tuning * fill);
 			}
+			e += diagonal;
+			if(e < Safety * diagonal) e = diagonal;
+			before = e > 0 ? 1 / std::sqrt(e) : 0;
+			precon.set(i,j,k, before);
+		}
+	});
+}
 
-      // r = r - alpha * q
-      maxR = 0.;
+//! z = (L L')^-1 r, solving into z in place. Solid cells of z are left
+//! as they are.
+inline void apply(const ConstructGrid<real>& precon, const ConstructGrid<real>& skip, const ConstructGrid<real>& r, ConstructGrid<real>& z) {
+	const int last = skip.domain.res[0] - 1;
+	// L q = r
+	wavefronts(skip.domain, false, [&](int j, int k) {
+		real before = 0;  // precon * q of (i-1,j,k)
+		for(int i=1;i<last;++i) {
+			const real pc = precon.gets(i,j,k);
+			if(pc == 0) { before = 0; continue; }
+			real t = r.gets(i,j,k) + before;
+			if(skip.gets(i,j-1,k) != 1) t += precon.gets(i,j-1,k) * z.gets(i,j-1,k);
+			if(skip.gets(i,j,k-1) != 1) t += precon.gets(i,j,k-1) * z.gets(i,j,k-1);
+			const real q = t * pc;
+			z.set(i,j,k, q);
+			before = pc * q;
+		}
+	});
+	// L' z = q
+	wavefronts(skip.domain, true, [&](int j, int k) {
+		real after = 0;  // z of (i+1,j,k)
+		for(int i=last-1;i>=1;--i) {
+			const real pc = precon.gets(i,j,k);
+			if(pc == 0) { after = 0; continue; }
+			real t = after;
+			if(skip.gets(i,j+1,k) != 1) t += z.gets(i,j+1,k);
+			if(skip.gets(i,j,k+1) != 1) t += z.gets(i,j,k+1);
+			after = (z.gets(i,j,k) + pc * t) * pc;
+			z.set(i,j,k, after);
+		}
+	});
+}
+
+};
+
+//! Solve the pressure Poisson problem of a projection: on the fluid cells
+//! of skip, the sum of p over fluid neighbors less p times their count
+//! equals divergence (in cell units, ASSUMED CUBIC CELLS!), less the
+//! mean of divergence over fluid cells: with no fixed cells the system
+//! is singular, and only solvable with a mean-free right-hand side. p
+//! starts from 0, or from its contents for a warm start. Conjugate Gradient takes
+//! scratch grids from slots 2 to 4 and 8 of the workspace, and its
+//! preconditioners slots 6, 7 and 9 up; multigrid runs V-cycles (see
+//! multigrid::solve).
+inline SolverStats solvePressure(ConstructGrid<real>& p, const ConstructGrid<real>& divergence, const ConstructGrid<real>& skip,
+  const ConvergencePolicy& policy, GridWorkspace& workspace, PoissonSolver solver = SolverCG) {
+  const Domain& domain = p.domain;
+	if(!policy.warmStart) p.fill(0);
+  if(solver == SolverMultigrid) return multigrid::solve(p, divergence, skip, policy, workspace);
+  ConstructGrid<real>& r = workspace.grid(2, domain);
+  ConstructGrid<real>& d = workspace.grid(3, domain);
+  ConstructGrid<real>& q = workspace.grid(4, domain);
+  ConstructGrid<real>& w = workspace.grid(8, domain);
+
+	// z = M^-1 r, the preconditioned residual. Without a preconditioner z
+	// is r itself.
+	const bool preconditioned = solver == SolverMICCG || solver == SolverMultigridCG;
+	ConstructGrid<real>& z = preconditioned ? workspace.grid(7, domain) : r;
+	std::unique_ptr<multigrid::Preconditioner> cycle;
+	if(solver == SolverMICCG) mic::factor(skip, workspace.grid(6, domain));
+	if(solver == SolverMultigridCG) cycle.reset(new multigrid::Preconditioner(z, r, skip, workspace));
+	if(preconditioned) z.fill(0);
+	auto precondition = [&]() {
+		if(solver == SolverMICCG) mic::apply(workspace.grid(6, domain), skip, r, z);
+		if(solver == SolverMultigridCG) cycle->apply();
+	};
+
+    // Conjugate Gradient 
+    // (http://en.wikipedia.org/wiki/Conjugate_gradient_method)
+    // as rearranged by Chronopoulos and Gear, "s-step iterative methods
+    // for symmetric linear systems" (1989): A is applied to z rather than
+    // to d, and A d kept by recurrence, so that both dot products of an
+    // iteration come from one pass, fused with the stencil. Each
+    // iteration makes two passes over the grids, where the textbook loop
+    // makes six. Passes walk rows along x through pointers, weighting
+    // neighbors by 1 (fluid) or 0 (solid) rather than branching.
+    if(p.layout != LayoutLinear || divergence.layout != LayoutLinear || skip.layout != LayoutLinear)
+      throw std::logic_error("Pressure solves need linear grids.");
+    const int nx = domain.res[0];
+    auto row = [](const ConstructGrid<real>& g, int j, int k) { return g.data + g.index(0,j,k); };
 
-//#pragma omp parallel for reduction(+:maxR)      
-      for(int k=1;k<domain.res[2]-1;++k)  
-      for(int j=1;j<domain.res[1]-1;++j)
-      for(int i=1;i<domain.res[0]-1;++i) {
-        maxR = r.gets(i,j,k) > maxR ? r.gets(i,j,k) : maxR;
+    // y = A x (or mean - rhs - A x), returning the sums of y * x and
+    // other * x, and the largest y and sum of its squares
+    const real mean = multigrid::fluidMean(divergence, skip);
+    struct Apply { real yx, xo, largest, squares; };
+    auto apply = [&](const ConstructGrid<real>& x, ConstructGrid<real>& y, const ConstructGrid<real>& other, const ConstructGrid<real>* rhs) {
+      real yx = 0., xo = 0., largest = 0., squares = 0.;
+#pragma omp parallel for reduction(+:yx,xo,squares) reduction(max:largest)
+      for(int k=1;k<domain.res[2]-1;++k) 
+      for(int j=1;j<domain.res[1]-1;++j) {
+        const real *S = row(skip,j,k), *Sy0 = row(skip,j-1,k), *Sy1 = row(skip,j+1,k), *Sz0 = row(skip,j,k-1), *Sz1 = row(skip,j,k+1);
+        const real *X = row(x,j,k), *Xy0 = row(x,j-1,k), *Xy1 = row(x,j+1,k), *Xz0 = row(x,j,k-1), *Xz1 = row(x,j,k+1);
+        const real *O = row(other,j,k), *B = rhs ? row(*rhs,j,k) : 0;
+        real* Y = row(y,j,k);
+        for(int i=1;i<nx-1;++i) {
+          const real fx0 = S[i-1]!=1, fy0 = Sy0[i]!=1, fz0 = Sz0[i]!=1, fx1 = S[i+1]!=1, fy1 = Sy1[i]!=1, fz1 = Sz1[i]!=1;
+          const real center = fx0 + fy0 + fz0 + fx1 + fy1 + fz1;
+          real R = fx0 * X[i-1] + fy0 * Xy0[i] + fz0 * Xz0[i] + fx1 * X[i+1] + fy1 * Xy1[i] + fz1 * Xz1[i];
+          R = center * X[i] - R;
+          if(B) R = mean - B[i] - R;
+          R = S[i]==1 ? 0. : R;
+          Y[i] = R;
+          yx += R * X[i];
+          xo += O[i] * X[i];
+          largest = std::max(largest, std::fabs(R));
+          squares += R * R;
+        }
       }
+      Apply a = { yx, xo, largest, squares };
+      return a;
+    };
 
-      real deltaOld = deltaNew;
+    // r = b - Ax
+    SolverStats stats;
+    const Apply initial = apply(p, r, p, &divergence);
+    stats.initialResidual = stats.residual = policy.measure(initial.largest, initial.squares);
+    stats.converged = policy.converged(stats.residual, stats.initialResidual);
+    if(stats.converged || policy.iterations <= 0) return stats;
 
-      // deltaNew = r'r
-      deltaNew = 0.;
-#pragma omp parallel for reduction(+:deltaNew)      
-      for(int k=1;k<domain.res[2]-1;++k)
-      for(int j=1;j<domain.res[1]-1;++j)
-      for(int i=1;i<domain.res[0]-1;++i) 
-      { deltaNew += r.gets(i,j,k) * r.gets(i,j,k); }
+    // w = A z, gamma = r'z, delta = w'z
+    real gamma = 0., delta = 0.;
+    auto stencil = [&]() {
+      const Apply a = apply(z, w, r, 0);
+      delta = a.yx;
+      gamma = a.xo;
+    };
+    precondition();
+    stencil();
 
-      real beta = deltaNew / deltaOld;
+    real alpha = 0., beta = 0., gammaOld = 0.;
+    int iter=0;
+    for(;;) {
+      // The first direction is z itself
+      const bool first = iter == 0;
+      if(!first) {
+        beta = gamma / gammaOld;
+        alpha = delta - beta * gamma / alpha;
+      } else alpha = delta;
+      alpha = fabs(alpha) > .0 ? gamma / alpha : 0.;
 
-      // d = r + beta * d
-#pragma omp parallel for
+      // d = z + beta * d, q = w + beta * q (= A d), x = x + alpha * d, 
+      // r = r - alpha * q, and the norm of r
+      real largest = 0., squares = 0.;
+#pragma omp parallel for reduction(max:largest) reduction(+:squares)
       for(int k=1;k<domain.res[2]-1;++k) 
-      for(int j=1;j<domain.res[1]-1;++j)
-      for(int i=1;i<domain.res[0]-1;++i)
-      {  d.set(i,j,k, r.get(i,j,k) + beta * d.gets(i,j,k));  }
+      for(int j=1;j<domain.res[1]-1;++j) {
+        const real *Z = row(z,j,k), *W = row(w,j,k);
+        real *D = row(d,j,k), *Q = row(q,j,k), *P = row(p,j,k), *R = row(r,j,k);
+        for(int i=1;i<nx-1;++i) {
+          D[i] = first ? Z[i] : Z[i] + beta * D[i];
+          Q[i] = first ? W[i] : W[i] + beta * Q[i];
+          P[i] += alpha * D[i];
+          R[i] -= alpha * Q[i];
+          largest = std::max(largest, std::fabs(R[i]));
+          squares += R[i] * R[i];
+        }
+      }
+      stats.residual = policy.measure(largest, squares);
+      stats.converged = policy.converged(stats.residual, stats.initialResidual);
 
       // Next iteration...
-      ++iter;
+      stats.iterations = ++iter;
 #if 0
       if(iter%10==0)
       {
         using namespace std;
-        cout << "Iteration " << iter << " -- Error: " << maxR << endl;
+        cout << "Iteration " << iter << " -- Error: " << stats.residual << endl;
       }
 #endif
+      if(stats.converged || iter >= policy.iterations) return stats;
+      gammaOld = gamma;
+      precondition();
+      stencil();
+    }
+}
+
+#include <iostream>
+// Divergence-Free Projection
+// Use Helmholtz-Hodge decomposition to compute div-free component of a vector field
+template<> SolverStats ConstructGrid<Vec3>::divFree(ScalarField boundary, const ConvergencePolicy& policy, GridWorkspace& workspace, 
+	ConstructGrid<real>& p, PoissonSolver solver) {
+	if(!p.domain.sameLattice(domain)) throw std::logic_error("Pressure grid is on another domain.");
+	ConvergencePolicy warm = policy;
+	warm.warmStart = true;
+	ConstructGrid<real>& divergence = workspace.grid(1, domain);
+  ConstructGrid<real>& skip = workspace.grid(5, domain);
+  solidCells(skip, boundary);
+
+  // TODO: Generalize this for other boundaries and conditions (Dirichlet, etc)
+	// Set no flux for velocity
+#pragma omp parallel for
+    for(int k=0;k<domain.res[2];++k) 
+    for(int j=0;j<domain.res[1];++j)
+    for(int i=0;i<domain.res[0];++i) {
+      if(i==0 || i==domain.res[0]-1) set(i,j,k, gets(i,j,k).cwiseProduct(Vec3(0,1,1)));
+      if(j==0 || j==domain.res[1]-1) set(i,j,k, gets(i,j,k).cwiseProduct(Vec3(1,0,1)));
+      if(k==0 || k==domain.res[2]-1) set(i,j,k, gets(i,j,k).cwiseProduct(Vec3(1,1,0)));
     }
 
+	// Compute divergence of non-boundary cells
+#pragma omp parallel for
+    for(int k=1;k<domain.res[2]-1;++k) 
+    for(int j=1;j<domain.res[1]-1;++j)
+    for(int i=1;i<domain.res[0]-1;++i) {
+      real D = gets(i+1,j,k)[0] + gets(i,j+1,k)[1] + gets(i,j,k+1)[2];
+			D -= gets(i-1,j,k)[0] + gets(i,j-1,k)[1] + gets(i,j,k-1)[2];
+			D *= .5f;
+      divergence.set(i,j,k, D ); // ASSUMED CUBIC CELLS!
+    }
+
+    const SolverStats stats = solvePressure(p, divergence, skip, warm, workspace, solver);
+
 #pragma omp parallel for
     for(int k=0;k<domain.res[2];++k) 
     for(int j=0;j<domain.res[1];++j)
@@ -325,32 +1191,101 @@ template<> void ConstructGrid<Vec3>::divFree(ScalarField boundary, int iteration
     for(int k=1;k<domain.res[2]-1;++k) 
     for(int j=1;j<domain.res[1]-1;++j)
     for(int i=1;i<domain.res[0]-1;++i) {
-      Vec3 V = get(i,j,k);
+      Vec3 V = gets(i,j,k);
       V[0] -= (p.gets(i+1,j,k) - p.gets(i-1,j,k)) * .5f; 
       V[1] -= (p.gets(i,j+1,k) - p.gets(i,j-1,k)) * .5f;
       V[2] -= (p.gets(i,j,k+1) - p.gets(i,j,k-1)) * .5f;
       set(i,j,k,V);
     }
+    fillHalo();
+    return stats;
 }
 
-inline VectorField divFree(VectorField field, ScalarField boundary, const Domain& domain, int iterations=30) {
+//! The pressure is kept in workspace slot 0, zeroed unless warm started
+template<> SolverStats ConstructGrid<Vec3>::divFree(ScalarField boundary, const ConvergencePolicy& policy, GridWorkspace& workspace, PoissonSolver solver) {
+	ConstructGrid<real>& p = workspace.grid(0, domain);
+	if(!policy.warmStart) p.fill(0);
+	return divFree(boundary, policy, workspace, p, solver);
+}
+
+//! The solve's statistics go to stats, if given. Given a pressure grid
+//! on domain, the solve starts from it and leaves its solution there.
+inline VectorField divFree(VectorField field, ScalarField boundary, const Domain& domain, const ConvergencePolicy& policy=ConvergencePolicy(30), 
+	int halo=0, GridLayout layout=LayoutLinear, PoissonSolver solver=SolverCG, SolverStats* stats=NULL, ConstructGrid<real>* pressure=NULL) {
 	// TODO: build in isGridded() check and create shortcut for fields that are already grids
 	// so we don't waste time writing them to a grid a second time
 
-	ConstructGrid<Vec3> *grid = new ConstructGrid<Vec3>(domain, constant(Vec3(0,0,0)).node);
+	ConstructGrid<Vec3> *grid = new ConstructGrid<Vec3>(domain, constant(Vec3(0,0,0)).node, halo, HaloOutside, layout);
 	grid->bakeData(field.node);
-	grid->divFree(boundary, iterations);
+	GridWorkspace workspace;
+	const SolverStats solved = pressure ? grid->divFree(boundary, policy, workspace, *pressure, solver) : 
+		grid->divFree(boundary, policy, workspace, solver);
+	if(stats) *stats = solved;
 	return VectorField(grid);
 }
 
 
-template<typename T>
-inline Field<T> writeToGrid(Field<T> field, Field<T> outside, Domain domain) {
-	ConstructGrid<T> *grid = new ConstructGrid<T>(domain, outside.node);
+//! Bakes field to a grid, stored as in writeToGrid<real,StoreHalf>(...)
+//! when a storage policy is given
+template<typename T, typename S = StoreFloat>
+inline Field<T> writeToGrid(Field<T> field, Field<T> outside, Domain domain, 
+	int halo = 0, HaloRule rule = HaloOutside, GridLayout layout = LayoutLinear, 
+	GridInterpolation interpolation = InterpolateLinear) {
+	ConstructGrid<T,S> *grid = new ConstructGrid<T,S>(domain, outside.node, halo, rule, layout, interpolation);
   grid->bakeData(field.node);
   return Field<T>(grid);
 }
 
+//! Ping-pong grids for simulation state. Each bake writes the next state
+//! to the back grid, which the source may not sample, and swaps it to the
+//! front. The back grid is rebaked in place unless something still holds
+//! it, so stepping a simulation allocates no grids.
+template<typename T, typename S = StoreFloat>
+class GridBuffer {
+	typedef ConstructGrid<T,S> Grid;
+	Domain domain;
+	typename ConstructFieldNode<T>::ptr outside;
+	int halo;
+	HaloRule rule;
+	GridLayout layout;
+	GridInterpolation interpolation;
+	typename ConstructFieldNode<T>::ptr nodes[2];
+	Grid* grids[2];
+
+	void make(int b) {
+		grids[b] = new Grid(domain, outside, halo, rule, layout, interpolation);
+		nodes[b] = adopt<T>(grids[b]);
+	}
+
+public:
+	//! As writeToGrid, with field as the initial state
+	GridBuffer(Field<T> field, Field<T> outside, Domain domain, 
+		int halo = 0, HaloRule rule = HaloOutside, GridLayout layout = LayoutLinear, 
+		GridInterpolation interpolation = InterpolateLinear)
+	: domain(domain), outside(outside.node), halo(halo), rule(rule), layout(layout), interpolation(interpolation) {
+		make(0);
+		grids[0]->bakeData(field.node);
+	}
+
+	//! The grid holding the current state
+	Grid& front() const { return *grids[0]; }
+
+	//! The grid for the next state. A new one if the last holder of the
+	//! old state there is still around.
+	Grid& back() {
+		if(!nodes[1] || nodes[1].use_count() > 1) make(1);
+		return *grids[1];
+	}
+
+	void swap() { std::swap(nodes[0], nodes[1]); std::swap(grids[0], grids[1]); }
+
+	//! Make source, evaluated on the current state, the next state
+	void bake(Field<T> source) { back().bakeData(source.node); swap(); }
+
+	Field<T> field() const { return Field<T>(nodes[0]); }
+	operator Field<T>() const { return field(); }
+};
+
 template<typename T>
 inline Field<T> loadGriddedField(const char *path, Field<T> outside) {
 	const Domain fake(1,1,1, Vec3(-1,-1,-1), Vec3(1,1,1));
@@ -0,0 +1,464 @@
+#ifndef ConstructJIT_h
+#define ConstructJIT_h
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <string>
+#include <sstream>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <cerrno>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <pwd.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "construct/ConstructField.h"
+#include "construct/ConstructProgram.h"
+namespace Construct {
+
+//////////////////////////////////////////////////////////
+// Native code for field expressions. A compiled Program is translated
+// into C++, built into a shared object by the system compiler and loaded
+// with dlopen. Constants and leaves are passed in at run time, so the
+// generated code depends only on the shape of the expression and one
+// kernel serves every expression of that shape.
+//
+// Environment: CONSTRUCT_JIT_CXX names the compiler (default g++) and
+// CONSTRUCT_JIT_CACHE the directory of built kernels (default
+// $XDG_CACHE_HOME/construct-jit or ~/.cache/construct-jit). Kernels are
+// named by a hash of their source and of the CPU they target, so later
+// runs load them from disk without compiling again. Kernels are only
+// loaded from a directory, and files, owned by the user and writable by
+// nobody else.
+
+//! Generated kernel: leaf table, constant tables (reals, packed Vec3,
+//! column-major Mat3), n <= BlockSize packed points in, packed values out
+typedef void (*JitKernel)(const Leaf* leaves, const real* R, const real* V, const real* M,
+  const real* xs, real* out, size_t n);
+
+//! Translates a Program, before register allocation, into the source of
+//! a JitKernel named construct_kernel.
+//!
+//! Instructions between two leaves fuse into one loop over the points,
+//! with every value a local variable. Only values read by a leaf, or in
+//! a later loop, are written out to per-block arrays.
+class JitGenerator {
+  const Program& p;
+  int resultFile;
+  std::vector<int> segment[3];  //! Loop defining each register
+  std::vector<bool> leafValue[3], stored[3];
+  int current;                  //! Loop being emitted
+  std::ostringstream body;
+
+  static const char* prefix(int file) { return file == RealRegisters ? "r" : file == VectorRegisters ? "v" : "m"; }
+  static int count(int file) { return file == RealRegisters ? 1 : file == VectorRegisters ? 3 : 9; }
+
+  //! Component k of register reg, as seen from the current loop
+  std::string at(int file, int reg, int k=0) const {
+    std::ostringstream s;
+    const int c = count(file);
+    if(file == VectorRegisters && reg == 0) s << "xs[3*i+" << k << "]";
+    else if(leafValue[file][reg] || segment[file][reg] != current)
+      s << prefix(file) << reg << "a[" << c << "*i+" << k << "]";
+    else if(c == 1) s << prefix(file) << reg;
+    else s << prefix(file) << reg << "_" << k;
+    return s.str();
+  }
+  //! Block array holding a vector register
+  std::string block(int reg) const {
+    std::ostringstream s;
+    if(reg == 0) s << "xs"; else s << "v" << reg << "a";
+    return s.str();
+  }
+
+  //! Declares component k of the destination
+  void define(int file, int reg, int k, const std::string& value) {
+    body << "    const float " << prefix(file) << reg;
+    if(count(file) > 1) body << "_" << k;
+    body << " = " << value << ";\n";
+  }
+
+  std::string A(const Instruction& in, int file, int k=0) const { return at(file, in.a, k); }
+  std::string B(const Instruction& in, int file, int k=0) const { return at(file, in.b, k); }
+  // Column-major matrix element (r,c)
+  static int e(int r, int c) { return 3*c + r; }
+
+public:
+  JitGenerator(const Program& p, int resultFile) : p(p), resultFile(resultFile), current(-1) { }
+
+  //! The kernel source, or an empty string if the program uses an
+  //! instruction the generator does not translate
+  std::string source() {
+    // Assign every instruction to a loop. Leaves each get their own.
+    std::vector<int> loop(p.code.size());
+    for(int f=0;f<3;++f) {
+      segment[f].assign(p.registers[f], -1);
+      leafValue[f].assign(p.registers[f], false);
+      stored[f].assign(p.registers[f], false);
+    }
+    int s = 0;
+    for(size_t pc=0;pc<p.code.size();++pc) {
+      const Instruction& in = p.code[pc];
+      if(in.op == OpSolve) return std::string();
+      const OperandFiles t(in.op);
+      if(in.x >= 0) { loop[pc] = ++s; ++s; leafValue[t.dst][in.dst] = true; }
+      else loop[pc] = s;
+      segment[t.dst][in.dst] = loop[pc];
+    }
+    // Values read outside their own loop need a block array
+    for(size_t pc=0;pc<p.code.size();++pc) {
+      const Instruction& in = p.code[pc];
+      const OperandFiles t(in.op);
+      if(t.a >= 0 && segment[t.a][in.a] != loop[pc]) stored[t.a][in.a] = true;
+      if(t.b >= 0 && segment[t.b][in.b] != loop[pc]) stored[t.b][in.b] = true;
+      if(in.x > 0) stored[VectorRegisters][in.x] = true;
+    }
+    const int last = p.code.empty() ? -1 : loop.back();
+    const bool direct = !(resultFile == VectorRegisters && p.result == 0) &&
+      !leafValue[resultFile][p.result] && segment[resultFile][p.result] == last;
+    if(!direct) stored[resultFile][p.result] = true;
+
+    std::ostringstream src;
+    src << "#include <cstddef>\n#include <cmath>\n"
+        << "struct Leaf { const void* node; void (*evalBlock)(const void*, const float*, void*, size_t); };\n"
+        << "extern \"C\" void construct_kernel(const Leaf* L, const float* R, const float* V, const float* M,\n"
+        << "  const float* xs, float* out, size_t n) {\n";
+    for(int f=0;f<3;++f)
+      for(int r=0;r<p.registers[f];++r)
+        if((stored[f][r] || leafValue[f][r]) && !(f == VectorRegisters && r == 0))
+          src << "  float " << prefix(f) << r << "a[" << count(f) * BlockSize << "];\n";
+
+    bool open = false;
+    for(size_t pc=0;pc<p.code.size();++pc) {
+      const Instruction& in = p.code[pc];
+      const OperandFiles t(in.op);
+      current = loop[pc];
+      if(in.x >= 0) {
+        if(open) { body << "  }\n"; open = false; }
+        body << "  L[" << in.slot << "].evalBlock(L[" << in.slot << "].node, " << block(in.x)
+             << ", " << prefix(t.dst) << in.dst << "a, n);\n";
+        continue;
+      }
+      if(!open) { body << "  for(size_t i=0;i<n;++i) {\n"; open = true; }
+      instruction(in);
+      const int d = in.dst, f = t.dst;
+      if(stored[f][d])
+        for(int k=0;k<count(f);++k)
+          body << "    " << prefix(f) << d << "a[" << count(f) << "*i+" << k << "] = " << at(f, d, k) << ";\n";
+      if(direct && f == resultFile && d == p.result)
+        for(int k=0;k<count(f);++k)
+          body << "    out[" << count(f) << "*i+" << k << "] = " << at(f, d, k) << ";\n";
+    }
+    if(open) body << "  }\n";
+    if(!direct) {
+      current = -2;
+      const int c = count(resultFile);
+      body << "  for(size_t i=0;i<n;++i) {\n";
+      for(int k=0;k<c;++k)
+        body << "    out[" << c << "*i+" << k << "] = " << at(resultFile, p.result, k) << ";\n";
+      body << "  }\n";
+    }
+    src << body.str() << "}\n";
+    return src.str();
+  }
+
+private:
+  //! Per point code for one instruction, matching execute()
+  void instruction(const Instruction& in) {
+    const int R = RealRegisters, V = VectorRegisters, M = MatrixRegisters;
+    const int d = in.dst;
+    std::ostringstream s;
+    switch(in.op) {
+      case OpConstR: s << "R[" << in.slot << "]"; define(R, d, 0, s.str()); break;
+      case OpConstV: for(int k=0;k<3;++k) { std::ostringstream c; c << "V[" << 3*in.slot+k << "]"; define(V, d, k, c.str()); } break;
+      case OpConstM: for(int k=0;k<9;++k) { std::ostringstream c; c << "M[" << 9*in.slot+k << "]"; define(M, d, k, c.str()); } break;
+
+      case OpAddR: define(R, d, 0, A(in,R) + " + " + B(in,R)); break;
+      case OpAddV: for(int k=0;k<3;++k) define(V, d, k, A(in,V,k) + " + " + B(in,V,k)); break;
+      case OpAddM: for(int k=0;k<9;++k) define(M, d, k, A(in,M,k) + " + " + B(in,M,k)); break;
+      case OpSubR: define(R, d, 0, A(in,R) + " - " + B(in,R)); break;
+      case OpSubV: for(int k=0;k<3;++k) define(V, d, k, A(in,V,k) + " - " + B(in,V,k)); break;
+      case OpSubM: for(int k=0;k<9;++k) define(M, d, k, A(in,M,k) + " - " + B(in,M,k)); break;
+
+      case OpMulRR: define(R, d, 0, A(in,R) + " * " + B(in,R)); break;
+      case OpMulVR: for(int k=0;k<3;++k) define(V, d, k, A(in,V,k) + " * " + B(in,R)); break;
+      case OpMulMV: { for(int r=0;r<3;++r)
+          define(V, d, r, A(in,M,e(r,0)) + "*" + B(in,V,0) + " + " + A(in,M,e(r,1)) + "*" + B(in,V,1) + " + " + A(in,M,e(r,2)) + "*" + B(in,V,2));
+        break; }
+      case OpMulMM: { for(int c=0;c<3;++c) for(int r=0;r<3;++r)
+          define(M, d, e(r,c), A(in,M,e(r,0)) + "*" + B(in,M,e(0,c)) + " + " + A(in,M,e(r,1)) + "*" + B(in,M,e(1,c)) + " + " + A(in,M,e(r,2)) + "*" + B(in,M,e(2,c)));
+        break; }
+      case OpMulMR: for(int k=0;k<9;++k) define(M, d, k, A(in,M,k) + " * " + B(in,R)); break;
+      case OpMulRM: for(int k=0;k<9;++k) define(M, d, k, A(in,R) + " * " + B(in,M,k)); break;
+
+      case OpDivR: define(R, d, 0, A(in,R) + " / " + B(in,R)); break;
+      case OpDivV: for(int k=0;k<3;++k) define(V, d, k, A(in,V,k) + " * (1.f / " + B(in,R) + ")"); break;
+      case OpDivM: for(int k=0;k<9;++k) define(M, d, k, A(in,M,k) + " / " + B(in,R)); break;
+
+      case OpLength: define(R, d, 0, "std::sqrt(" + A(in,V,0) + "*" + A(in,V,0) + " + " + A(in,V,1) + "*" + A(in,V,1) + " + " + A(in,V,2) + "*" + A(in,V,2) + ")"); break;
+      case OpDot: define(R, d, 0, A(in,V,0) + "*" + B(in,V,0) + " + " + A(in,V,1) + "*" + B(in,V,1) + " + " + A(in,V,2) + "*" + B(in,V,2)); break;
+      case OpCross:
+        define(V, d, 0, A(in,V,1) + "*" + B(in,V,2) + " - " + A(in,V,2) + "*" + B(in,V,1));
+        define(V, d, 1, A(in,V,2) + "*" + B(in,V,0) + " - " + A(in,V,0) + "*" + B(in,V,2));
+        define(V, d, 2, A(in,V,0) + "*" + B(in,V,1) + " - " + A(in,V,1) + "*" + B(in,V,0));
+        break;
+      case OpOuter: for(int c=0;c<3;++c) for(int r=0;r<3;++r) define(M, d, e(r,c), A(in,V,r) + " * " + B(in,V,c)); break;
+      case OpTranspose: for(int c=0;c<3;++c) for(int r=0;r<3;++r) define(M, d, e(r,c), A(in,M,e(c,r))); break;
+      case OpSolve: break; // Rejected by source()
+
+      case OpMask: define(R, d, 0, A(in,R) + " > 0 ? 1.f : 0.f"); break;
+      case OpAbsR: define(R, d, 0, "std::fabs(" + A(in,R) + ")"); break;
+      case OpAbsV: for(int k=0;k<3;++k) define(V, d, k, "std::fabs(" + A(in,V,k) + ")"); break;
+      case OpAbsM: for(int k=0;k<9;++k) define(M, d, k, "std::fabs(" + A(in,M,k) + ")"); break;
+
+      case OpSkew:
+        define(M, d, e(0,0), "0.f"); define(M, d, e(0,1), "-" + A(in,V,2)); define(M, d, e(0,2), A(in,V,1));
+        define(M, d, e(1,0), A(in,V,2)); define(M, d, e(1,1), "0.f"); define(M, d, e(1,2), "-" + A(in,V,0));
+        define(M, d, e(2,0), "-" + A(in,V,1)); define(M, d, e(2,1), A(in,V,0)); define(M, d, e(2,2), "0.f");
+        break;
+      case OpTrace: define(R, d, 0, A(in,M,e(0,0)) + " + " + A(in,M,e(1,1)) + " + " + A(in,M,e(2,2))); break;
+      case OpCurl:
+        define(V, d, 0, A(in,M,e(2,1)) + " - " + A(in,M,e(1,2)));
+        define(V, d, 1, A(in,M,e(0,2)) + " - " + A(in,M,e(2,0)));
+        define(V, d, 2, A(in,M,e(1,0)) + " - " + A(in,M,e(0,1)));
+        break;
+
+      // Leaves are emitted by source()
+      case OpSampleR: case OpSampleV: case OpCallR: case OpCallV: case OpCallM: break;
+    }
+  }
+};
+
+//////////////////////////////////////////////////////////
+//! Builds and loads kernels, keeping each loaded kernel for the life of
+//! the process
+struct JitCache {
+  std::mutex lock;
+  std::map<std::string, JitKernel> loaded;
+  std::string native; //! target(), found on the first kernel
+  bool probed;
+
+  JitCache() : probed(false) { }
+
+  static JitCache& instance() { static JitCache cache; return cache; }
+
+  static const char* compiler() { const char* c = getenv("CONSTRUCT_JIT_CXX"); return c ? c : "g++"; }
+  static const char* flags() { return "-O3 -ffast-math -fPIC -shared -w"; }
+
+  //! CONSTRUCT_JIT_CACHE, else construct-jit in the user's cache directory
+  //! ($XDG_CACHE_HOME or ~/.cache); empty if there is none
+  static std::string directory() {
+    if(const char* d = getenv("CONSTRUCT_JIT_CACHE")) return d;
+    std::string base;
+    const char* xdg = getenv("XDG_CACHE_HOME");
+    const char* home = getenv("HOME");
+    const passwd* pw = home ? NULL : getpwuid(geteuid());
+    if(xdg && xdg[0] == '/') base = xdg;
+    else if(home) base = std::string(home) + "/.cache";
+    else if(pw) base = std::string(pw->pw_dir) + "/.cache";
+    else return base;
+    mkdir(base.c_str(), 0700);
+    return base + "/construct-jit";
+  }
+
+  //! Whether an open file belongs to us and nobody else can write it
+  static bool trusted(int fd) {
+    struct stat st;
+    return fstat(fd, &st) == 0 && st.st_uid == geteuid() && !(st.st_mode & (S_IWGRP | S_IWOTH));
+  }
+
+  //! Run a command without a shell, true if it exits with status 0. Its
+  //! standard output goes to out, if given.
+  static bool run(const std::vector<std::string>& args, std::string* out = NULL) {
+    std::vector<char*> argv;
+    for(size_t i=0;i<args.size();++i) argv.push_back(const_cast<char*>(args[i].c_str()));
+    argv.push_back(NULL);
+    int pipes[2];
+    if(out && pipe(pipes) != 0) return false;
+    const pid_t pid = fork();
+    if(pid == 0) {
+      if(out) { dup2(pipes[1], 1); close(pipes[0]); close(pipes[1]); }
+      execvp(argv[0], argv.data());
+      _exit(127);
+    }
+    if(out) {
+      close(pipes[1]);
+      char buffer[4096];
+      ssize_t n;
+      while(pid > 0 && ((n = read(pipes[0], buffer, sizeof(buffer))) > 0 || (n < 0 && errno == EINTR)))
+        if(n > 0) out->append(buffer, n);
+      close(pipes[0]);
+    }
+    if(pid < 0) return false;
+    int status;
+    while(waitpid(pid, &status, 0) < 0) if(errno != EINTR) return false;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+  }
+
+  //! What -march=native resolves to here, as the compiler describes it.
+  //! Part of every kernel's key, so a cache shared between machines never
+  //! hands one CPU's code to another. Empty if the compiler cannot say;
+  //! kernels are then built for its default target.
+  static std::string target() {
+    std::vector<std::string> args(1, compiler());
+    args.push_back("-march=native"); args.push_back("-Q"); args.push_back("--help=target");
+    std::string description;
+    return run(args, &description) ? description : std::string();
+  }
+
+  //! Compile source into dir/name, through a private name and a rename so
+  //! concurrent processes never load a half written object
+  static bool build(int dirfd, const std::string& dir, const std::string& name, const std::string& source, bool native) {
+    std::ostringstream tmp;
+    tmp << name << "." << getpid();
+    const std::string cpp = tmp.str() + ".cpp", obj = tmp.str() + ".so";
+    const int fd = openat(dirfd, cpp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if(fd < 0) return false;
+    const bool written = write(fd, source.data(), source.size()) == (ssize_t)source.size();
+    close(fd);
+
+    std::vector<std::string> args(1, compiler());
+    std::istringstream split(flags());
+    for(std::string flag; split >> flag; ) args.push_back(flag);
+    if(native) args.push_back("-march=native");
+    args.push_back("-o"); args.push_back(dir + "/" + obj);
+    args.push_back(dir + "/" + cpp);
+    const bool built = written && run(args);
+    unlinkat(dirfd, cpp.c_str(), 0);
+    if(built && renameat(dirfd, obj.c_str(), dirfd, name.c_str()) == 0) return true;
+    unlinkat(dirfd, obj.c_str(), 0);
+    return false;
+  }
+
+  //! Load dir/name if it is a regular file we own. The library is opened
+  //! by its own name, which dlopen tells apart from other kernels', and is
+  //! refused if that name no longer leads to the file that was checked.
+  static JitKernel load(int dirfd, const std::string& dir, const std::string& name) {
+    const int fd = openat(dirfd, name.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if(fd < 0) return NULL;
+    struct stat checked, opened;
+    JitKernel k = NULL;
+    if(trusted(fd) && fstat(fd, &checked) == 0 && S_ISREG(checked.st_mode)) {
+      const std::string path = dir + "/" + name;
+      if(void* library = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL)) {
+        if(stat(path.c_str(), &opened) == 0 && opened.st_dev == checked.st_dev && opened.st_ino == checked.st_ino)
+          k = reinterpret_cast<JitKernel>(dlsym(library, "construct_kernel"));
+        else dlclose(library);
+      }
+    }
+    close(fd);
+    return k;
+  }
+
+  //! 64 bit FNV-1a
+  static std::string hash(const std::string& text) {
+    uint64_t h = 14695981039346656037ULL;
+    for(size_t i=0;i<text.size();++i) { h ^= (unsigned char)text[i]; h *= 1099511628211ULL; }
+    char name[17];
+    snprintf(name, sizeof(name), "%016llx", (unsigned long long)h);
+    return name;
+  }
+
+  //! The kernel built from source, or null if it could not be built. The
+  //! cache directory must belong to us and be closed to everyone else.
+  JitKernel kernel(const std::string& source) {
+    std::lock_guard<std::mutex> guard(lock);
+    if(!probed) { native = target(); probed = true; }
+    const std::string key = hash(source + compiler() + flags() + native);
+    std::map<std::string, JitKernel>::const_iterator it = loaded.find(key);
+    if(it != loaded.end()) return it->second;
+
+    const std::string dir = directory();
+    if(dir.empty()) return loaded[key] = NULL;
+    mkdir(dir.c_str(), 0700);
+    const int dirfd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(dirfd < 0) return loaded[key] = NULL;
+    JitKernel k = NULL;
+    if(trusted(dirfd)) {
+      const std::string name = "kernel_" + key + ".so";
+      if(faccessat(dirfd, name.c_str(), F_OK, 0) == 0 || build(dirfd, dir, name, source, !native.empty()))
+        k = load(dirfd, dir, name);
+    }
+    close(dirfd);
+    return loaded[key] = k;
+  }
+};
+
+//! A plan together with its native kernel, null if none could be built
+struct JitPlan : public Plan {
+  JitKernel kernel;
+  JitPlan() : kernel(NULL) { }
+};
+
+//////////////////////////////////////////////////////////
+//! A field evaluated by a natively compiled kernel
+template<typename T>
+struct JitField : public ConstructFieldNode<T> {
+  typedef typename ConstructFieldNode<T>::ptr Ptr;
+  Ptr source; //! Keeps the leaves referenced by the program alive
+  Program program;
+  JitKernel kernel;
+
+  //! The expression is simplified before it is translated. kernel is
+  //! null if no native code could be built for it. Expressions of a
+  //! shape seen before reuse its kernel without generating code.
+  JitField(Ptr field) : source(Construct::simplify(Field<T>(field)).node), kernel(NULL) {
+    FieldShape shape;
+    shape(source);
+    PlanCache<JitPlan>& cache = PlanCache<JitPlan>::instance();
+    if(const std::shared_ptr<const JitPlan> plan = cache.find(shape)) {
+      program = plan->bind(shape);
+      kernel = plan->kernel;
+      return;
+    }
+
+    std::shared_ptr<JitPlan> plan(new JitPlan());
+    const bool reusable = lowerPlan(*source, shape, *plan);
+    const std::string code = JitGenerator(plan->program, Register<T>::File).source();
+    if(!code.empty()) plan->kernel = JitCache::instance().kernel(code);
+    if(reusable) cache.insert(shape, plan);
+    program = plan->program;
+    kernel = plan->kernel;
+  }
+
+  T eval(const Vec3& x) const {
+    T result;
+    evalBlock(&x, &result, 1);
+    return result;
+  }
+
+  void evalBlock(const Vec3* xs, T* out, size_t n) const {
+    kernel(program.leaves.data(), program.realConstants.data(),
+      Scalars<Vec3>::ptr(program.vectorConstants.data()), Scalars<Mat3>::ptr(program.matrixConstants.data()),
+      Scalars<Vec3>::ptr(xs), Scalars<T>::ptr(out), n);
+  }
+
+  typename FieldInfo<T>::GradType grad(const Vec3& x) const
+  { return source->grad(x); }
+  ValueAndGrad<T> evalWithGrad(const Vec3& x) const
+  { return source->evalWithGrad(x); }
+
+  int compileGrad(FieldCompiler& c, int x) const
+  { return c.lowerGrad(*source, x); }
+  void shape(FieldShape& s) const
+  { s(source); }
+};
+
+//! Compile an expression to native code. Falls back silently to the
+//! interpreted program of compile() when no kernel can be built (no
+//! compiler on the system, or instructions the generator does not
+//! translate); native, if given, is set to whether a kernel was built.
+template<typename T>
+inline Field<T> jit(Field<T> field, bool* native = NULL) {
+  JitField<T>* f = new JitField<T>(field.node);
+  if(native) *native = f->kernel != NULL;
+  if(f->kernel) return Field<T>(f);
+  delete f;
+  return compile(field);
+}
+
+};
+#endif
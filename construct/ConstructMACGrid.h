@@ -0,0 +1,187 @@
+#ifndef ConstructMACGrid_h
+#define ConstructMACGrid_h
+#include "construct/ConstructField.h"
+#include "construct/ConstructAlgebra.h"
+#include "construct/ConstructDomain.h"
+#include "construct/ConstructGrid.h"
+namespace Construct {
+
+//////////////////////////////////////////////////////////
+//! A staggered (marker-and-cell) velocity grid. Cells are centered on the
+//! lattice points of the domain; each velocity component is stored on the
+//! faces normal to its axis, halfway between two cells, so u has one more
+//! value than there are cells along x (and v along y, w along z). The
+//! divergence of a cell and the pressure gradient across a face are exact
+//! differences of neighboring values, without the checkerboard modes of
+//! collocated central differences.
+struct MACGrid : public ConstructFieldNode<Vec3> {
+	//! Cell domain
+	Domain domain;
+
+	//! Face-centered components, each a scalar grid on its own face lattice
+	ConstructGrid<real> u, v, w;
+
+	//! The lattice of faces normal to axis: shifted half a cell down along
+	//! it, with one more point
+	static Domain faces(const Domain& d, int axis) {
+		int res[3] = { d.res[0], d.res[1], d.res[2] };
+		res[axis] += 1;
+		Vec3 shift = Vec3::Zero();
+		shift[axis] = d.H[axis] * .5f;
+		return Domain(res[0], res[1], res[2], d.bmin - shift, d.bmax + shift);
+	}
+
+	MACGrid(Domain domain, VectorField outside, int halo = 0)
+	: domain(domain),
+	  u(faces(domain,0), dot(outside, VectorField(Vec3(1,0,0))).node, halo),
+	  v(faces(domain,1), dot(outside, VectorField(Vec3(0,1,0))).node, halo),
+	  w(faces(domain,2), dot(outside, VectorField(Vec3(0,0,1))).node, halo) { }
+
+	ConstructGrid<real>& component(int axis) { return axis == 0 ? u : axis == 1 ? v : w; }
+	const ConstructGrid<real>& component(int axis) const { return axis == 0 ? u : axis == 1 ? v : w; }
+
+	//! Bake each component of source at its own faces
+	void bakeData(VectorField source) {
+		for(int a=0;a<3;++a) {
+			Vec3 axis = Vec3::Zero();
+			axis[a] = 1;
+			component(a).bakeData(dot(source, VectorField(axis)).node);
+		}
+	}
+
+	Vec3 eval(const Vec3& x) const
+	{ return Vec3(u.ConstructGrid<real>::eval(x), v.ConstructGrid<real>::eval(x), w.ConstructGrid<real>::eval(x)); }
+
+	//! Each component is sampled in its own block pass
+	void evalBlock(const Vec3* xs, Vec3* out, size_t n) const {
+		real c[BlockSize];
+		for(int a=0;a<3;++a) {
+			component(a).ConstructGrid<real>::evalBlock(xs, c, n);
+			for(size_t s=0;s<n;++s) out[s][a] = c[s];
+		}
+	}
+
+	//! Compiled programs sample the grid without going through the vtable
+	static void sampleBlock(const void* grid, const Vec3* xs, void* out, size_t n)
+	{ static_cast<const MACGrid*>(grid)->MACGrid::evalBlock(xs, static_cast<Vec3*>(out), n); }
+	int compile(FieldCompiler& c, int x) const
+	{ return c.leaf<Vec3>(Register<Vec3>::Sample, this, &sampleBlock, x); }
+
+	//! Column c of the gradient is the gradient of component c
+	ValueAndGrad<Vec3> evalWithGrad(const Vec3& x) const {
+		Vec3 value;
+		Mat3 G;
+		for(int a=0;a<3;++a) {
+			const ValueAndGrad<real> f = component(a).ConstructGrid<real>::evalWithGrad(x);
+			value[a] = f.value;
+			G(0,a) = f.grad[0]; G(1,a) = f.grad[1]; G(2,a) = f.grad[2];
+		}
+		return ValueAndGrad<Vec3>(value, G);
+	}
+
+	Mat3 grad(const Vec3& x) const { return evalWithGrad(x).grad; }
+
+	real spacing() const { return domain.H.minCoeff(); }
+
+	//! Divergence of cell (i,j,k), from the flux through its six faces
+	inline real divergence(int i, int j, int k) const {
+		return (u.gets(i+1,j,k) - u.gets(i,j,k)) * domain.Hinverse[0] +
+			(v.gets(i,j+1,k) - v.gets(i,j,k)) * domain.Hinverse[1] +
+			(w.gets(i,j,k+1) - w.gets(i,j,k)) * domain.Hinverse[2];
+	}
+
+	//! True if the cell on the lower side of face (i,j,k) normal to axis,
+	//! and the cell above it, are both on the lattice and not solid
+	inline bool open(int axis, int i, int j, int k, const ConstructGrid<real>& skip) const {
+		const int lo[3] = { i - (axis == 0), j - (axis == 1), k - (axis == 2) };
+		return domain.inside(lo[0],lo[1],lo[2]) && domain.inside(i,j,k) &&
+			skip.gets(lo[0],lo[1],lo[2]) != 1 && skip.gets(i,j,k) != 1;
+	}
+
+	//! Subtract scale times the gradient of the cell-centered p from every
+	//! open face
+	void subtractGradient(const ConstructGrid<real>& p, const ConstructGrid<real>& skip, real scale = 1) {
+		for(int a=0;a<3;++a) {
+			ConstructGrid<real>& g = component(a);
+			const real s = scale * domain.Hinverse[a];
+			const int* r = g.domain.res;
+			#pragma omp parallel for
+			for(int k=0;k<r[2];++k)
+			for(int j=0;j<r[1];++j)
+			for(int i=0;i<r[0];++i)
+				if(open(a,i,j,k,skip))
+					g.set(i,j,k, g.gets(i,j,k) - s * (p.gets(i,j,k) - p.gets(i-(a==0),j-(a==1),k-(a==2))));
+			g.fillHalo();
+		}
+	}
+
+	//! Divergence-Free projection, as ConstructGrid<Vec3>::divFree. Faces
+	//! of solid cells carry no flux.
+	SolverStats divFree(ScalarField boundary, const ConvergencePolicy& policy, GridWorkspace& workspace, PoissonSolver solver = SolverCG) {
+		ConstructGrid<real>& p = workspace.grid(0, domain);
+		if(!policy.warmStart) p.fill(0);
+		return divFree(boundary, policy, workspace, p, solver);
+	}
+
+	//! Solving into pressure, a grid on the cell domain kept by the caller
+	//! from step to step: each solve starts from the last one's solution
+	//! (the first from 0, as new grids read 0).
+	SolverStats divFree(ScalarField boundary, const ConvergencePolicy& policy, GridWorkspace& workspace, ConstructGrid<real>& p, 
+		PoissonSolver solver = SolverCG) {
+		if(!p.domain.sameLattice(domain)) throw std::logic_error("Pressure grid is on another domain.");
+		ConvergencePolicy warm = policy;
+		warm.warmStart = true;
+		ConstructGrid<real>& cellDivergence = workspace.grid(1, domain);
+		ConstructGrid<real>& skip = workspace.grid(5, domain);
+		solidCells(skip, boundary);
+
+		for(int a=0;a<3;++a) {
+			ConstructGrid<real>& g = component(a);
+			const int* r = g.domain.res;
+			#pragma omp parallel for
+			for(int k=0;k<r[2];++k)
+			for(int j=0;j<r[1];++j)
+			for(int i=0;i<r[0];++i)
+				if(!open(a,i,j,k,skip)) g.set(i,j,k, 0);
+		}
+
+		// In cell units, as the solver works (ASSUMED CUBIC CELLS!)
+		#pragma omp parallel for
+		for(int k=0;k<domain.res[2];++k)
+		for(int j=0;j<domain.res[1];++j)
+		for(int i=0;i<domain.res[0];++i)
+			cellDivergence.set(i,j,k, skip.gets(i,j,k) == 1 ? 0 : divergence(i,j,k) * domain.H[0]);
+
+		const SolverStats stats = solvePressure(p, cellDivergence, skip, warm, workspace, solver);
+		subtractGradient(p, skip, domain.H[0]);
+		return stats;
+	}
+
+	SolverStats divFree(ScalarField boundary, const ConvergencePolicy& policy) {
+		GridWorkspace workspace;
+		return divFree(boundary, policy, workspace);
+	}
+};
+
+//! Bakes field to a staggered grid
+inline VectorField writeToMACGrid(VectorField field, VectorField outside, Domain domain, int halo = 0) {
+	MACGrid* grid = new MACGrid(domain, outside, halo);
+	grid->bakeData(field);
+	return VectorField(grid);
+}
+
+//! As divFree, projecting on a staggered grid
+inline VectorField divFreeMAC(VectorField field, ScalarField boundary, const Domain& domain, 
+	const ConvergencePolicy& policy = ConvergencePolicy(30), int halo = 0, PoissonSolver solver = SolverCG, SolverStats* stats = NULL,
+	ConstructGrid<real>* pressure = NULL) {
+	MACGrid* grid = new MACGrid(domain, constant(Vec3(0,0,0)), halo);
+	grid->bakeData(field);
+	GridWorkspace workspace;
+	const SolverStats solved = pressure ? grid->divFree(boundary, policy, workspace, *pressure, solver) : 
+		grid->divFree(boundary, policy, workspace, solver);
+	if(stats) *stats = solved;
+	return VectorField(grid);
+}
+
+};
+#endif
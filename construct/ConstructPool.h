@@ -0,0 +1,179 @@
+#ifndef ConstructPool_h
+#define ConstructPool_h
+#include <vector>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <new>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+namespace Construct {
+
+//////////////////////////////////////////////////////////
+// Recycled storage for the objects a simulation creates and destroys
+// every step: expression nodes (with their reference counts) and grid
+// buffers. Freed memory is kept for reuse instead of going back to the
+// system allocator.
+
+//! Per-thread free lists of small blocks, by size class. Blocks freed on
+//! another thread than allocated them move to that thread's lists; each
+//! list keeps at most Kept blocks, so a thread that only frees (a worker
+//! releasing nodes built elsewhere) does not hoard them.
+class NodePool {
+  enum { Granularity = 16, Classes = 32, Kept = 512 }; // Blocks of up to 496 bytes are pooled
+  std::vector<void*> free[Classes];
+  static bool& alive() { static thread_local bool a = false; return a; }
+
+  NodePool() { alive() = true; }
+  ~NodePool() {
+    alive() = false;
+    for(int c=0;c<Classes;++c)
+      for(size_t i=0;i<free[c].size();++i) ::operator delete(free[c][i]);
+  }
+  static NodePool& local() { static thread_local NodePool pool; return pool; }
+
+public:
+  static void* allocate(size_t bytes) {
+    const size_t c = (bytes + Granularity - 1) / Granularity;
+    if(c >= Classes) return ::operator new(bytes);
+    NodePool& pool = local();
+    if(pool.free[c].empty()) return ::operator new(c * Granularity);
+    void* p = pool.free[c].back();
+    pool.free[c].pop_back();
+    return p;
+  }
+
+  //! Blocks freed while the thread exits, after its pool is gone, go
+  //! straight back to the system
+  static void deallocate(void* p, size_t bytes) {
+    const size_t c = (bytes + Granularity - 1) / Granularity;
+    if(c >= Classes || !alive()) { ::operator delete(p); return; }
+    std::vector<void*>& list = local().free[c];
+    if(list.size() >= (size_t)Kept) { ::operator delete(p); return; }
+    list.push_back(p);
+  }
+};
+
+//! Standard allocator over NodePool, for shared_ptr control blocks
+template<typename T>
+struct PoolAllocator {
+  typedef T value_type;
+  PoolAllocator() { }
+  template<typename U> PoolAllocator(const PoolAllocator<U>&) { }
+  T* allocate(size_t n) { return static_cast<T*>(NodePool::allocate(n * sizeof(T))); }
+  void deallocate(T* p, size_t n) { NodePool::deallocate(p, n * sizeof(T)); }
+  template<typename U> bool operator==(const PoolAllocator<U>&) const { return true; }
+  template<typename U> bool operator!=(const PoolAllocator<U>&) const { return false; }
+};
+
+//! Memory for grid buffers. On Linux, buffers of a huge page or more are
+//! mapped aligned to huge pages and marked for transparent huge pages;
+//! smaller ones are cache-line aligned. Mapped pages are placed on the
+//! NUMA node of the thread that first writes them.
+//!
+//! Mapped buffers start a different number of cache lines into their
+//! first page. Were they all aligned alike, element i of every grid would
+//! fall in the same cache set and 4K-alias the others, and a loop over
+//! several grids (a solver update) would run an order of magnitude slow.
+struct GridMemory {
+  enum { CacheLine = 64, HugePage = 2 << 20, Colors = 64, Stagger = 17 * CacheLine };
+
+  static void* allocate(size_t bytes) {
+#if defined(__linux__)
+    if(bytes >= (size_t)HugePage) {
+      static std::atomic<unsigned> next(0);
+      const size_t offset = (next++ % Colors) * Stagger;
+      const size_t run = rounded(bytes + offset), mapped = run + HugePage;
+      char* p = static_cast<char*>(mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+      if(p == MAP_FAILED) throw std::bad_alloc();
+      // Trim the mapping to a huge-page aligned run
+      char* aligned = reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(p) + HugePage - 1) & ~(uintptr_t)(HugePage - 1));
+      if(aligned > p) munmap(p, aligned - p);
+      if(p + mapped > aligned + run) munmap(aligned + run, p + mapped - aligned - run);
+#if defined(MADV_HUGEPAGE)
+      madvise(aligned, run, MADV_HUGEPAGE);
+#endif
+      return aligned + offset;
+    }
+    void* p = NULL;
+    if(posix_memalign(&p, CacheLine, bytes)) throw std::bad_alloc();
+    return p;
+#else
+    return ::operator new(bytes);
+#endif
+  }
+
+  static void release(void* p, size_t bytes) {
+#if defined(__linux__)
+    if(bytes >= (size_t)HugePage) {
+      // The offset is what p lies past its huge page
+      const size_t offset = reinterpret_cast<uintptr_t>(p) & (HugePage - 1);
+      munmap(static_cast<char*>(p) - offset, rounded(bytes + offset));
+    }
+    else free(p);
+#else
+    ::operator delete(p);
+#endif
+  }
+
+private:
+  static size_t rounded(size_t bytes) { return (bytes + HugePage - 1) & ~(size_t)(HugePage - 1); }
+};
+
+//! Process-wide grid buffers of type T by element count. A few buffers of
+//! each size are kept, which covers the grids a solver step creates. T
+//! must be a type that needs no construction, like the grid value types.
+template<typename T>
+class BufferPool {
+  enum { Kept = 8 }; //! Buffers kept per size
+  std::mutex lock;
+  std::multimap<size_t, T*> free;
+  static bool& alive() { static bool a = false; return a; }
+
+  BufferPool() { alive() = true; }
+  ~BufferPool() {
+    alive() = false;
+    for(typename std::multimap<size_t, T*>::iterator it=free.begin();it!=free.end();++it) 
+      GridMemory::release(it->second, it->first * sizeof(T));
+  }
+  static BufferPool& instance() { static BufferPool pool; return pool; }
+
+public:
+  //! Uninitialized storage for n values. fresh, if given, is set when
+  //! the memory is newly allocated rather than recycled, so its pages
+  //! are not yet placed.
+  static T* acquire(size_t n, bool* fresh = NULL) {
+    BufferPool& pool = instance();
+    if(fresh) *fresh = false;
+    {
+      std::lock_guard<std::mutex> guard(pool.lock);
+      typename std::multimap<size_t, T*>::iterator it = pool.free.find(n);
+      if(it != pool.free.end()) {
+        T* data = it->second;
+        pool.free.erase(it);
+        return data;
+      }
+    }
+    if(fresh) *fresh = true;
+    return static_cast<T*>(GridMemory::allocate(n * sizeof(T)));
+  }
+
+  //! Buffers released at exit, after the pool is gone, are simply freed
+  static void release(T* data, size_t n) {
+    if(!data) return;
+    if(!alive()) { GridMemory::release(data, n * sizeof(T)); return; }
+    BufferPool& pool = instance();
+    {
+      std::lock_guard<std::mutex> guard(pool.lock);
+      if(pool.free.count(n) < (size_t)Kept) { pool.free.insert(std::make_pair(n, data)); return; }
+    }
+    GridMemory::release(data, n * sizeof(T));
+  }
+};
+
+};
+#endif
@@ -0,0 +1,576 @@
+#ifndef ConstructProgram_h
+#define ConstructProgram_h
+#include <vector>
+#include <memory>
+#include <map>
+#include <tuple>
+#include <mutex>
+#include <algorithm>
+#include "construct/ConstructField.h"
+#include "construct/ConstructSIMD.h"
+namespace Construct {
+
+//////////////////////////////////////////////////////////
+//! Instruction set of compiled field programs. Operand types are part
+//! of the opcode: R = real, V = Vec3, M = Mat3.
+enum OpCode {
+  OpConstR, OpConstV, OpConstM,         // dst = constant[slot]
+  OpAddR, OpAddV, OpAddM,               // dst = a + b
+  OpSubR, OpSubV, OpSubM,               // dst = a - b
+  OpMulRR, OpMulVR, OpMulMV,            // dst = a * b
+  OpMulMM, OpMulMR, OpMulRM,
+  OpDivR, OpDivV, OpDivM,               // dst = a / b, b real
+  OpLength, OpDot, OpCross, OpOuter,    // vector algebra
+  OpTranspose, OpSolve,                 // matrix algebra
+  OpMask, OpAbsR, OpAbsV, OpAbsM,       // utilities
+  OpSkew, OpTrace, OpCurl,              // derivative assembly: [a]x, tr(a), curl from gradient a
+  OpSampleR, OpSampleV,                 // dst = grid[slot] sampled at points x
+  OpCallR, OpCallV, OpCallM             // dst = node[slot]->evalBlock(points x)
+};
+
+//! Register files, one per value type
+enum RegisterFile { RealRegisters, VectorRegisters, MatrixRegisters };
+
+template<typename> struct Register;
+template<> struct Register<real> {
+  enum { File = RealRegisters };
+  static const OpCode Const = OpConstR, Add = OpAddR, Sub = OpSubR, Div = OpDivR,
+    Abs = OpAbsR, Sample = OpSampleR, Call = OpCallR;
+};
+template<> struct Register<Vec3> {
+  enum { File = VectorRegisters };
+  static const OpCode Const = OpConstV, Add = OpAddV, Sub = OpSubV, Div = OpDivV,
+    Abs = OpAbsV, Sample = OpSampleV, Call = OpCallV;
+};
+template<> struct Register<Mat3> {
+  enum { File = MatrixRegisters };
+  static const OpCode Const = OpConstM, Add = OpAddM, Sub = OpSubM, Div = OpDivM,
+    Abs = OpAbsM, Sample = OpCallM, Call = OpCallM;
+};
+
+//! Opcode for Left * Right
+template<typename Left, typename Right> struct MulOp;
+template<> struct MulOp<real,real> { static const OpCode Code = OpMulRR; };
+template<> struct MulOp<Vec3,real> { static const OpCode Code = OpMulVR; };
+template<> struct MulOp<Mat3,Vec3> { static const OpCode Code = OpMulMV; };
+template<> struct MulOp<Mat3,Mat3> { static const OpCode Code = OpMulMM; };
+template<> struct MulOp<Mat3,real> { static const OpCode Code = OpMulMR; };
+template<> struct MulOp<real,Mat3> { static const OpCode Code = OpMulRM; };
+
+//! One instruction. Register operands index into the register file of
+//! their type; x is always a vector register holding sample points.
+struct Instruction {
+  OpCode op;
+  int dst, a, b;
+  int x;    //! Sample points, for instructions that evaluate leaves
+  int slot; //! Index into the constant or leaf tables
+};
+
+//! A leaf of the expression which the program evaluates as a whole block,
+//! such as a grid or a node which has no lowering of its own.
+struct Leaf {
+  const void* node;
+  void (*evalBlock)(const void* node, const Vec3* xs, void* out, size_t n);
+};
+
+template<typename T>
+inline void evalLeaf(const void* node, const Vec3* xs, void* out, size_t n)
+{ static_cast<const ConstructFieldNode<T>*>(node)->evalBlock(xs, static_cast<T*>(out), n); }
+
+//////////////////////////////////////////////////////////
+//! A field expression flattened into a linear register program.
+//! Vector register 0 holds the sample points on entry.
+struct Program {
+  std::vector<Instruction> code;
+  std::vector<real> realConstants;
+  std::vector<Vec3> vectorConstants;
+  std::vector<Mat3> matrixConstants;
+  std::vector<Leaf> leaves;
+  int registers[3]; //! Number of registers in each file
+  int result;       //! Register holding the value of the expression
+
+  Program() : result(0) { registers[0] = 0; registers[1] = 1; registers[2] = 0; }
+};
+
+//! Scratch storage for running a program over one block of points
+struct RegisterState {
+  std::vector<real> R;
+  std::vector<Vec3> V;
+  std::vector<Mat3> M;
+  void reserve(const Program& p) {
+    if(R.size() < (size_t)p.registers[0] * BlockSize) R.resize(p.registers[0] * BlockSize);
+    if(V.size() < (size_t)p.registers[1] * BlockSize) V.resize(p.registers[1] * BlockSize);
+    if(M.size() < (size_t)p.registers[2] * BlockSize) M.resize(p.registers[2] * BlockSize);
+  }
+  real* r(int i) { return &R[i * BlockSize]; }
+  Vec3* v(int i) { return &V[i * BlockSize]; }
+  Mat3* m(int i) { return &M[i * BlockSize]; }
+};
+
+//! Per-thread pool of register states. Each run takes its own state, so
+//! nested and concurrent programs never share scratch memory.
+struct RegisterPool {
+  std::vector<std::unique_ptr<RegisterState> > free;
+  static RegisterPool& local() { static thread_local RegisterPool pool; return pool; }
+  RegisterState* acquire() {
+    if(free.empty()) return new RegisterState();
+    RegisterState* s = free.back().release();
+    free.pop_back();
+    return s;
+  }
+  void release(RegisterState* s) { free.push_back(std::unique_ptr<RegisterState>(s)); }
+};
+
+template<typename T>
+inline void evalGradLeaf(const void* node, const Vec3* xs, void* out, size_t n) {
+  typedef typename FieldInfo<T>::GradType GradType;
+  const ConstructFieldNode<T>* f = static_cast<const ConstructFieldNode<T>*>(node);
+  for(size_t i=0;i<n;++i) static_cast<GradType*>(out)[i] = f->grad(xs[i]);
+}
+
+//////////////////////////////////////////////////////////
+//! Lowers field expression trees into a Program. Nodes call back into
+//! the compiler from ConstructFieldNode::compile and compileGrad.
+//!
+//! Lowering is memoized per (node, sample points) pair and identical
+//! instructions are emitted only once, so a sub-DAG referenced from
+//! several places, or needed for both its value and its gradient, is
+//! evaluated once per sample point.
+//!
+//! Given the shape of the expression, constants bound there take the
+//! first slots of the constant tables and every leaf remembers which
+//! node of the shape it calls, so the program can be rebound to any
+//! expression of the same shape (see Plan).
+struct FieldCompiler {
+  typedef std::pair<const void*, int> NodeKey;
+  typedef std::tuple<int, int, int, int, int> InstructionKey;
+
+  Program program;
+  std::map<NodeKey, int> values, gradients;
+  std::map<InstructionKey, int> emitted;
+  const FieldShape* shape;    //! Shape of the expression being lowered, or null
+  std::vector<int> leafNodes; //! Index in shape->nodes of the node of each leaf
+  bool bindable;              //! Whether the program depends on the shape alone
+
+  FieldCompiler(const FieldShape* shape = NULL) : shape(shape), bindable(shape != NULL) {
+    if(!shape) return;
+    program.realConstants = shape->reals;
+    program.vectorConstants = shape->vectors;
+    program.matrixConstants = shape->matrices;
+  }
+
+  //! Lower the value of a node evaluated at the points held in vector register x
+  template<typename T>
+  int lower(const ConstructFieldNode<T>& node, int x) {
+    const NodeKey key(&node, x);
+    std::map<NodeKey, int>::const_iterator it = values.find(key);
+    if(it != values.end()) return it->second;
+    if(shape && !shape->contains(&node)) bindable = false;
+    const int r = node.compile(*this, x);
+    values[key] = r;
+    return r;
+  }
+
+  //! Lower the gradient of a node evaluated at the points held in vector register x
+  template<typename T>
+  int lowerGrad(const ConstructFieldNode<T>& node, int x) {
+    const NodeKey key(&node, x);
+    std::map<NodeKey, int>::const_iterator it = gradients.find(key);
+    if(it != gradients.end()) return it->second;
+    if(shape && !shape->contains(&node)) bindable = false;
+    const int r = node.compileGrad(*this, x);
+    gradients[key] = r;
+    return r;
+  }
+
+  //! Append an instruction producing a register of type T, unless an
+  //! identical instruction has been emitted already
+  template<typename T>
+  int emit(OpCode op, int a, int b=-1, int x=-1, int slot=-1) {
+    const InstructionKey key(op, a, b, x, slot);
+    std::map<InstructionKey, int>::const_iterator it = emitted.find(key);
+    if(it != emitted.end()) return it->second;
+    Instruction inst = { op, program.registers[Register<T>::File]++, a, b, x, slot };
+    program.code.push_back(inst);
+    emitted[key] = inst.dst;
+    return inst.dst;
+  }
+
+  //! A constant fixed by the shape of the expression
+  int constant(const real& value)
+  { return emit<real>(OpConstR, -1, -1, -1, intern(program.realConstants, value, shape ? shape->reals.size() : 0)); }
+  int constant(const Vec3& value)
+  { return emit<Vec3>(OpConstV, -1, -1, -1, intern(program.vectorConstants, value, shape ? shape->vectors.size() : 0)); }
+  int constant(const Mat3& value)
+  { return emit<Mat3>(OpConstM, -1, -1, -1, intern(program.matrixConstants, value, shape ? shape->matrices.size() : 0)); }
+
+  //! A constant which node bound as its item'th binding in shape()
+  template<typename T>
+  int bound(const void* node, int item, const T& value) {
+    if(shape) {
+      std::map<FieldShape::Item, int>::const_iterator it = shape->slots.find(FieldShape::Item(node, item));
+      if(it != shape->slots.end()) return emit<T>(Register<T>::Const, -1, -1, -1, it->second);
+      bindable = false;
+    }
+    return constant(value);
+  }
+
+  //! Evaluate a node as an opaque leaf through its own evalBlock
+  template<typename T>
+  int call(const ConstructFieldNode<T>* node, int x)
+  { return leaf<T>(Register<T>::Call, node, &evalLeaf<T>, x); }
+
+  //! Evaluate the gradient of a node as an opaque leaf through its own grad
+  template<typename T>
+  int callGrad(const ConstructFieldNode<T>* node, int x) {
+    typedef typename FieldInfo<T>::GradType GradType;
+    return leaf<GradType>(Register<GradType>::Call, node, &evalGradLeaf<T>, x);
+  }
+
+  //! Evaluate a leaf with a dedicated block sampler (eg. grids)
+  template<typename T>
+  int leaf(OpCode op, const void* node, void (*fn)(const void*, const Vec3*, void*, size_t), int x) {
+    size_t slot = 0;
+    while(slot < program.leaves.size() && 
+      (program.leaves[slot].node != node || program.leaves[slot].evalBlock != fn)) ++slot;
+    if(slot == program.leaves.size()) {
+      Leaf l = { node, fn };
+      program.leaves.push_back(l);
+      std::map<const void*, int>::const_iterator it;
+      if(shape && (it = shape->ids.find(node)) != shape->ids.end()) leafNodes.push_back(it->second);
+      else { leafNodes.push_back(-1); bindable = false; }
+    }
+    return emit<T>(op, -1, -1, x, slot);
+  }
+
+private:
+  //! Index of value in a constant table at or after first, adding it if not present
+  template<typename T>
+  static int intern(std::vector<T>& table, const T& value, size_t first) {
+    for(size_t i=first;i<table.size();++i)
+      if(table[i] == value) return i;
+    table.push_back(value);
+    return table.size()-1;
+  }
+};
+
+// Default lowering: nodes the compiler does not understand become calls
+template<typename T>
+int ConstructFieldNode<T>::compile(FieldCompiler& c, int x) const
+{ return c.call(this, x); }
+template<typename T>
+int ConstructFieldNode<T>::compileGrad(FieldCompiler& c, int x) const
+{ return c.callGrad(this, x); }
+
+template<typename T>
+int ConstantField<T>::compile(FieldCompiler& c, int x) const
+{ return c.bound(this, 0, value); }
+template<typename T>
+int ConstantField<T>::compileGrad(FieldCompiler& c, int x) const
+{ return c.constant(FieldInfo<GradType>::Zero()); }
+template<> int ConstantField<Mat3>::compileGrad(FieldCompiler& c, int x) const
+{ return c.callGrad(this, x); }
+
+//////////////////////////////////////////////////////////
+//! Register files read (a, b) and written (dst) by an opcode, -1 if unused.
+//! Every instruction with x >= 0 also reads vector register x.
+struct OperandFiles {
+  int a, b, dst;
+  OperandFiles(OpCode op) : a(-1), b(-1), dst(-1) {
+    const int R = RealRegisters, V = VectorRegisters, M = MatrixRegisters;
+    switch(op) {
+      case OpConstR: case OpSampleR: case OpCallR: dst = R; break;
+      case OpConstV: case OpSampleV: case OpCallV: dst = V; break;
+      case OpConstM: case OpCallM: dst = M; break;
+      case OpAddR: case OpSubR: case OpMulRR: case OpDivR: a = R; b = R; dst = R; break;
+      case OpAddV: case OpSubV: case OpCross: a = V; b = V; dst = V; break;
+      case OpAddM: case OpSubM: case OpMulMM: a = M; b = M; dst = M; break;
+      case OpMulVR: case OpDivV: a = V; b = R; dst = V; break;
+      case OpMulMV: case OpSolve: a = M; b = V; dst = V; break;
+      case OpMulMR: case OpDivM: a = M; b = R; dst = M; break;
+      case OpMulRM: a = R; b = M; dst = M; break;
+      case OpLength: a = V; dst = R; break;
+      case OpDot: a = V; b = V; dst = R; break;
+      case OpOuter: a = V; b = V; dst = M; break;
+      case OpTranspose: case OpAbsM: a = M; dst = M; break;
+      case OpMask: case OpAbsR: a = R; dst = R; break;
+      case OpAbsV: a = V; dst = V; break;
+      case OpSkew: a = V; dst = M; break;
+      case OpTrace: a = M; dst = R; break;
+      case OpCurl: a = M; dst = V; break;
+    }
+  }
+};
+
+//! Register allocation pass. The compiler gives every instruction a fresh
+//! register; this renumbers them so a register is reused as soon as its
+//! last reader has run, keeping the per-block state small and cache hot.
+//! A destination never shares a register with that instruction's inputs.
+inline void allocateRegisters(Program& p, int resultFile) {
+  std::vector<int> lastUse[3];
+  for(int f=0;f<3;++f) lastUse[f].assign(p.registers[f], -1);
+  for(size_t i=0;i<p.code.size();++i) {
+    const Instruction& in = p.code[i];
+    const OperandFiles t(in.op);
+    if(t.a >= 0) lastUse[t.a][in.a] = i;
+    if(t.b >= 0) lastUse[t.b][in.b] = i;
+    if(in.x >= 0) lastUse[VectorRegisters][in.x] = i;
+  }
+  lastUse[resultFile][p.result] = p.code.size();
+  lastUse[VectorRegisters][0] = p.code.size();
+
+  std::vector<int> rename[3], freeList[3];
+  int count[3] = { 0, 1, 0 };
+  for(int f=0;f<3;++f) rename[f].assign(p.registers[f], -1);
+  rename[VectorRegisters][0] = 0;
+
+  for(size_t i=0;i<p.code.size();++i) {
+    Instruction& in = p.code[i];
+    const OperandFiles t(in.op);
+    const int reads[3][2] = { { t.a, in.a }, { t.b, in.b }, { in.x >= 0 ? (int)VectorRegisters : -1, in.x } };
+
+    const int old = in.dst;
+    if(freeList[t.dst].empty()) in.dst = count[t.dst]++;
+    else { in.dst = freeList[t.dst].back(); freeList[t.dst].pop_back(); }
+    rename[t.dst][old] = in.dst;
+    if(lastUse[t.dst][old] < 0) freeList[t.dst].push_back(in.dst); // Never read
+
+    for(int r=0;r<3;++r) {
+      const int f = reads[r][0], reg = reads[r][1];
+      if(f < 0) continue;
+      if(lastUse[f][reg] == (int)i) {
+        lastUse[f][reg] = -1; // Release once, even if read twice
+        freeList[f].push_back(rename[f][reg]);
+      }
+    }
+    if(t.a >= 0) in.a = rename[t.a][in.a];
+    if(t.b >= 0) in.b = rename[t.b][in.b];
+    if(in.x >= 0) in.x = rename[VectorRegisters][in.x];
+  }
+  p.result = rename[resultFile][p.result];
+  for(int f=0;f<3;++f) p.registers[f] = count[f];
+}
+
+//////////////////////////////////////////////////////////
+//! A program lowered once for all expressions of one shape
+struct Plan {
+  Program program;
+  std::vector<int> leafNodes; //! Index in FieldShape::nodes of the node of each leaf
+  std::vector<uint64_t> code; //! FieldShape::code of the expression it was lowered for
+
+  //! Whether s is the shape of this plan, not just one with the same hash
+  bool matches(const FieldShape& s) const {
+    return s.code == code && s.reals.size() <= program.realConstants.size() &&
+      s.vectors.size() <= program.vectorConstants.size() && s.matrices.size() <= program.matrixConstants.size();
+  }
+
+  //! The program reading the constants and leaves of an expression of this shape
+  Program bind(const FieldShape& s) const {
+    Program p = program;
+    std::copy(s.reals.begin(), s.reals.end(), p.realConstants.begin());
+    std::copy(s.vectors.begin(), s.vectors.end(), p.vectorConstants.begin());
+    std::copy(s.matrices.begin(), s.matrices.end(), p.matrixConstants.begin());
+    for(size_t i=0;i<p.leaves.size();++i) p.leaves[i].node = s.nodes[leafNodes[i]];
+    return p;
+  }
+};
+
+//! Lowers an expression against its shape into plan. Returns false if
+//! the program depends on more than the shape, so must not be reused.
+template<typename T>
+inline bool lowerPlan(const ConstructFieldNode<T>& source, const FieldShape& shape, Plan& plan) {
+  FieldCompiler c(&shape);
+  c.program.result = c.lower(source, 0);
+  plan.program = c.program;
+  plan.leafNodes = c.leafNodes;
+  plan.code = shape.code;
+  return c.bindable;
+}
+
+//! Process-wide plans of type P by shape hash. Simulations rebuild the
+//! same expressions over new grids every step; with the cache they are
+//! lowered and optimized on the first step only. Plans live as long as
+//! the process, one per distinct shape. A plan found under the hash of
+//! another shape is a miss.
+template<typename P>
+struct PlanCache {
+  std::mutex lock;
+  std::map<uint64_t, std::shared_ptr<const P> > plans;
+
+  static PlanCache& instance() { static PlanCache cache; return cache; }
+
+  std::shared_ptr<const P> find(const FieldShape& shape) {
+    std::lock_guard<std::mutex> guard(lock);
+    typename std::map<uint64_t, std::shared_ptr<const P> >::const_iterator it = plans.find(shape.hash);
+    return it == plans.end() || !it->second->matches(shape) ? std::shared_ptr<const P>() : it->second;
+  }
+  void insert(const FieldShape& shape, const std::shared_ptr<const P>& plan) {
+    std::lock_guard<std::mutex> guard(lock);
+    plans[shape.hash] = plan;
+  }
+};
+
+//////////////////////////////////////////////////////////
+//! Runs a program over n <= BlockSize points
+inline void execute(const Program& p, RegisterState& s, const Vec3* xs, size_t n) {
+  for(size_t i=0;i<n;++i) s.v(0)[i] = xs[i];
+
+  for(size_t pc=0;pc<p.code.size();++pc) {
+    const Instruction& in = p.code[pc];
+    switch(in.op) {
+      case OpConstR: { real* d = s.r(in.dst); const real c = p.realConstants[in.slot];
+        for(size_t i=0;i<n;++i) d[i] = c;
+        break; }
+      case OpConstV: { Vec3* d = s.v(in.dst); const Vec3& c = p.vectorConstants[in.slot];
+        for(size_t i=0;i<n;++i) d[i] = c;
+        break; }
+      case OpConstM: { Mat3* d = s.m(in.dst); const Mat3& c = p.matrixConstants[in.slot];
+        for(size_t i=0;i<n;++i) d[i] = c;
+        break; }
+
+      case OpAddR: simd::add(s.r(in.a), s.r(in.b), s.r(in.dst), n); break;
+      case OpAddV: simd::add(Scalars<Vec3>::ptr(s.v(in.a)), Scalars<Vec3>::ptr(s.v(in.b)), Scalars<Vec3>::ptr(s.v(in.dst)), 3*n); break;
+      case OpAddM: simd::add(Scalars<Mat3>::ptr(s.m(in.a)), Scalars<Mat3>::ptr(s.m(in.b)), Scalars<Mat3>::ptr(s.m(in.dst)), 9*n); break;
+      case OpSubR: simd::sub(s.r(in.a), s.r(in.b), s.r(in.dst), n); break;
+      case OpSubV: simd::sub(Scalars<Vec3>::ptr(s.v(in.a)), Scalars<Vec3>::ptr(s.v(in.b)), Scalars<Vec3>::ptr(s.v(in.dst)), 3*n); break;
+      case OpSubM: simd::sub(Scalars<Mat3>::ptr(s.m(in.a)), Scalars<Mat3>::ptr(s.m(in.b)), Scalars<Mat3>::ptr(s.m(in.dst)), 9*n); break;
+
+      case OpMulRR: simd::mul(s.r(in.a), s.r(in.b), s.r(in.dst), n); break;
+      case OpMulVR: simd::scale3(Scalars<Vec3>::ptr(s.v(in.a)), s.r(in.b), Scalars<Vec3>::ptr(s.v(in.dst)), n); break;
+      case OpMulMV: { const Mat3* a = s.m(in.a); const Vec3* b = s.v(in.b); Vec3* d = s.v(in.dst);
+        for(size_t i=0;i<n;++i) d[i] = a[i] * b[i];
+        break; }
+      case OpMulMM: { const Mat3* a = s.m(in.a); const Mat3* b = s.m(in.b); Mat3* d = s.m(in.dst);
+        for(size_t i=0;i<n;++i) d[i] = a[i] * b[i];
+        break; }
+      case OpMulMR: { const Mat3* a = s.m(in.a); const real* b = s.r(in.b); Mat3* d = s.m(in.dst);
+        for(size_t i=0;i<n;++i) d[i] = a[i] * b[i];
+        break; }
+      case OpMulRM: { const real* a = s.r(in.a); const Mat3* b = s.m(in.b); Mat3* d = s.m(in.dst);
+        for(size_t i=0;i<n;++i) d[i] = a[i] * b[i];
+        break; }
+
+      case OpDivR: simd::div(s.r(in.a), s.r(in.b), s.r(in.dst), n); break;
+      case OpDivV: { real inv[BlockSize]; simd::reciprocal(s.r(in.b), inv, n);
+        simd::scale3(Scalars<Vec3>::ptr(s.v(in.a)), inv, Scalars<Vec3>::ptr(s.v(in.dst)), n); break; }
+      case OpDivM: { const Mat3* a = s.m(in.a); const real* b = s.r(in.b); Mat3* d = s.m(in.dst);
+        for(size_t i=0;i<n;++i) d[i] = a[i] / b[i];
+        break; }
+
+      case OpLength: { SoABlock v; v.load(s.v(in.a), n);
+        simd::length(v.x, v.y, v.z, s.r(in.dst), n); break; }
+      case OpDot: { SoABlock a, b; a.load(s.v(in.a), n); b.load(s.v(in.b), n);
+        simd::dot(a, b, s.r(in.dst), n); break; }
+      case OpCross: { SoABlock a, b, d; a.load(s.v(in.a), n); b.load(s.v(in.b), n);
+        simd::cross(a, b, d, n); d.store(s.v(in.dst), n); break; }
+      case OpOuter: { const Vec3* a = s.v(in.a); const Vec3* b = s.v(in.b); Mat3* d = s.m(in.dst);
+        for(size_t i=0;i<n;++i) d[i] = a[i] * b[i].transpose();
+        break; }
+      case OpTranspose: { const Mat3* a = s.m(in.a); Mat3* d = s.m(in.dst);
+        for(size_t i=0;i<n;++i) d[i] = a[i].transpose();
+        break; }
+      case OpSolve: { const Mat3* a = s.m(in.a); const Vec3* b = s.v(in.b); Vec3* d = s.v(in.dst);
+        for(size_t i=0;i<n;++i) {
+          Eigen::FullPivLU<Mat3> lu(a[i]);
+          d[i] = lu.rank() < 3 ? Vec3(0,0,0) : Vec3(lu.solve(b[i]));
+        }
+        break; }
+
+      case OpMask: simd::step(s.r(in.a), s.r(in.dst), n); break;
+      case OpAbsR: { const real* a = s.r(in.a); real* d = s.r(in.dst);
+        for(size_t i=0;i<n;++i) d[i] = std::fabs(a[i]);
+        break; }
+      case OpAbsV: { const Vec3* a = s.v(in.a); Vec3* d = s.v(in.dst);
+        for(size_t i=0;i<n;++i) d[i] = a[i].cwiseAbs();
+        break; }
+      case OpAbsM: { const Mat3* a = s.m(in.a); Mat3* d = s.m(in.dst);
+        for(size_t i=0;i<n;++i) d[i] = a[i].cwiseAbs();
+        break; }
+
+      case OpSkew: { const Vec3* a = s.v(in.a); Mat3* d = s.m(in.dst);
+        for(size_t i=0;i<n;++i) d[i] <<
+          0, -a[i][2], a[i][1],
+          a[i][2], 0, -a[i][0],
+          -a[i][1], a[i][0], 0;
+        break; }
+      case OpTrace: { const Mat3* a = s.m(in.a); real* d = s.r(in.dst);
+        for(size_t i=0;i<n;++i) d[i] = a[i].trace();
+        break; }
+      case OpCurl: { const Mat3* a = s.m(in.a); Vec3* d = s.v(in.dst);
+        for(size_t i=0;i<n;++i) d[i] = Vec3(a[i](2,1) - a[i](1,2), a[i](0,2) - a[i](2,0), a[i](1,0) - a[i](0,1));
+        break; }
+
+      case OpSampleR: case OpCallR: { const Leaf& l = p.leaves[in.slot];
+        l.evalBlock(l.node, s.v(in.x), s.r(in.dst), n); break; }
+      case OpSampleV: case OpCallV: { const Leaf& l = p.leaves[in.slot];
+        l.evalBlock(l.node, s.v(in.x), s.v(in.dst), n); break; }
+      case OpCallM: { const Leaf& l = p.leaves[in.slot];
+        l.evalBlock(l.node, s.v(in.x), s.m(in.dst), n); break; }
+    }
+  }
+}
+
+//! Value of register r in the file for T
+template<typename T> T* registerBlock(RegisterState& s, int r);
+template<> inline real* registerBlock<real>(RegisterState& s, int r) { return s.r(r); }
+template<> inline Vec3* registerBlock<Vec3>(RegisterState& s, int r) { return s.v(r); }
+template<> inline Mat3* registerBlock<Mat3>(RegisterState& s, int r) { return s.m(r); }
+
+//////////////////////////////////////////////////////////
+//! A field evaluated by running its compiled program
+template<typename T>
+struct CompiledField : public ConstructFieldNode<T> {
+  typedef typename ConstructFieldNode<T>::ptr Ptr;
+  Ptr source; //! Keeps the leaves referenced by the program alive
+  Program program;
+
+  //! The expression is simplified before it is lowered. Expressions of
+  //! a shape seen before reuse its plan, bound to their own leaves.
+  CompiledField(Ptr field) : source(Construct::simplify(Field<T>(field)).node) {
+    FieldShape shape;
+    shape(source);
+    PlanCache<Plan>& cache = PlanCache<Plan>::instance();
+    if(const std::shared_ptr<const Plan> plan = cache.find(shape)) { program = plan->bind(shape); return; }
+
+    std::shared_ptr<Plan> plan(new Plan());
+    const bool reusable = lowerPlan(*source, shape, *plan);
+    allocateRegisters(plan->program, Register<T>::File);
+    if(reusable) cache.insert(shape, plan);
+    program = plan->program;
+  }
+
+  T eval(const Vec3& x) const {
+    T result;
+    evalBlock(&x, &result, 1);
+    return result;
+  }
+
+  void evalBlock(const Vec3* xs, T* out, size_t n) const {
+    RegisterPool& pool = RegisterPool::local();
+    RegisterState* s = pool.acquire();
+    s->reserve(program);
+    execute(program, *s, xs, n);
+    const T* result = registerBlock<T>(*s, program.result);
+    for(size_t i=0;i<n;++i) out[i] = result[i];
+    pool.release(s);
+  }
+
+  typename FieldInfo<T>::GradType grad(const Vec3& x) const
+  { return source->grad(x); }
+  ValueAndGrad<T> evalWithGrad(const Vec3& x) const
+  { return source->evalWithGrad(x); }
+
+  int compileGrad(FieldCompiler& c, int x) const
+  { return c.lowerGrad(*source, x); }
+  void shape(FieldShape& s) const
+  { s(source); }
+};
+
+//! Flatten an expression into a register program. The result evaluates
+//! exactly as the original field, without walking the tree per point.
+template<typename T>
+inline Field<T> compile(Field<T> field)
+{ return Field<T>(new CompiledField<T>(field.node)); }
+
+};
+#endif
@@ -0,0 +1,226 @@
+#ifndef ConstructSIMD_h
+#define ConstructSIMD_h
+#include <cstddef>
+#include <cmath>
+#include "construct/ConstructBase.h"
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace Construct {
+
+//////////////////////////////////////////////////////////
+//! Number of reals making up one value of a field type.
+//! Field values are stored packed, so an array of n values
+//! is also an array of n * Count reals.
+template<typename T> struct Scalars {
+  enum { Count = sizeof(T) / sizeof(real) };
+  static real* ptr(T* p) { return reinterpret_cast<real*>(p); }
+  static const real* ptr(const T* p) { return reinterpret_cast<const real*>(p); }
+};
+static_assert(sizeof(Vec3) == 3 * sizeof(real), "Vec3 must be tightly packed");
+static_assert(sizeof(Mat3) == 9 * sizeof(real), "Mat3 must be tightly packed");
+
+//////////////////////////////////////////////////////////
+//! Structure-of-arrays block of up to BlockSize points/vectors
+struct SoABlock {
+  real x[BlockSize], y[BlockSize], z[BlockSize];
+
+  //! Split an array of Vec3 into its x/y/z components
+  void load(const Vec3* v, size_t n) {
+    const real* p = Scalars<Vec3>::ptr(v);
+    for(size_t i=0;i<n;++i) { x[i] = p[3*i]; y[i] = p[3*i+1]; z[i] = p[3*i+2]; }
+  }
+
+  //! Interleave the x/y/z components back into an array of Vec3
+  void store(Vec3* v, size_t n) const {
+    real* p = Scalars<Vec3>::ptr(v);
+    for(size_t i=0;i<n;++i) { p[3*i] = x[i]; p[3*i+1] = y[i]; p[3*i+2] = z[i]; }
+  }
+};
+
+namespace simd {
+
+//////////////////////////////////////////////////////////
+// Packet abstraction: the widest vector unit the build enables
+#if defined(__AVX__)
+typedef __m256 Packet;
+enum { PacketSize = 8 };
+inline Packet pload(const real* p) { return _mm256_loadu_ps(p); }
+inline void pstore(real* p, Packet a) { _mm256_storeu_ps(p, a); }
+inline Packet pset1(real a) { return _mm256_set1_ps(a); }
+inline Packet padd(Packet a, Packet b) { return _mm256_add_ps(a, b); }
+inline Packet psub(Packet a, Packet b) { return _mm256_sub_ps(a, b); }
+inline Packet pmul(Packet a, Packet b) { return _mm256_mul_ps(a, b); }
+inline Packet pdiv(Packet a, Packet b) { return _mm256_div_ps(a, b); }
+inline Packet psqrt(Packet a) { return _mm256_sqrt_ps(a); }
+inline Packet pfloor(Packet a) { return _mm256_floor_ps(a); }
+//! 1 where a > 0, 0 elsewhere
+inline Packet pstep(Packet a)
+{ return _mm256_and_ps(_mm256_cmp_ps(a, _mm256_setzero_ps(), _CMP_GT_OQ), _mm256_set1_ps(1.f)); }
+#elif defined(__SSE2__)
+typedef __m128 Packet;
+enum { PacketSize = 4 };
+inline Packet pload(const real* p) { return _mm_loadu_ps(p); }
+inline void pstore(real* p, Packet a) { _mm_storeu_ps(p, a); }
+inline Packet pset1(real a) { return _mm_set1_ps(a); }
+inline Packet padd(Packet a, Packet b) { return _mm_add_ps(a, b); }
+inline Packet psub(Packet a, Packet b) { return _mm_sub_ps(a, b); }
+inline Packet pmul(Packet a, Packet b) { return _mm_mul_ps(a, b); }
+inline Packet pdiv(Packet a, Packet b) { return _mm_div_ps(a, b); }
+inline Packet psqrt(Packet a) { return _mm_sqrt_ps(a); }
+// No SSE4.1 round instruction: truncate, then step down where that rounded up
+inline Packet pfloor(Packet a) {
+  Packet t = _mm_cvtepi32_ps(_mm_cvttps_epi32(a));
+  return _mm_sub_ps(t, _mm_and_ps(_mm_cmpgt_ps(t, a), _mm_set1_ps(1.f)));
+}
+inline Packet pstep(Packet a)
+{ return _mm_and_ps(_mm_cmpgt_ps(a, _mm_setzero_ps()), _mm_set1_ps(1.f)); }
+#else
+typedef real Packet;
+enum { PacketSize = 1 };
+inline Packet pload(const real* p) { return *p; }
+inline void pstore(real* p, Packet a) { *p = a; }
+inline Packet pset1(real a) { return a; }
+inline Packet padd(Packet a, Packet b) { return a + b; }
+inline Packet psub(Packet a, Packet b) { return a - b; }
+inline Packet pmul(Packet a, Packet b) { return a * b; }
+inline Packet pdiv(Packet a, Packet b) { return a / b; }
+inline Packet psqrt(Packet a) { return std::sqrt(a); }
+inline Packet pfloor(Packet a) { return std::floor(a); }
+inline Packet pstep(Packet a) { return a > 0 ? static_cast<real>(1) : static_cast<real>(0); }
+#endif
+
+//////////////////////////////////////////////////////////
+// Kernels over arrays of reals. Each runs whole packets and then
+// finishes the remainder one element at a time.
+
+//! out = a + b
+inline void add(const real* a, const real* b, real* out, size_t n) {
+  size_t i=0;
+  for(;i+PacketSize<=n;i+=PacketSize) pstore(out+i, padd(pload(a+i), pload(b+i)));
+  for(;i<n;++i) out[i] = a[i] + b[i];
+}
+
+//! out = a - b
+inline void sub(const real* a, const real* b, real* out, size_t n) {
+  size_t i=0;
+  for(;i+PacketSize<=n;i+=PacketSize) pstore(out+i, psub(pload(a+i), pload(b+i)));
+  for(;i<n;++i) out[i] = a[i] - b[i];
+}
+
+//! out = a * b
+inline void mul(const real* a, const real* b, real* out, size_t n) {
+  size_t i=0;
+  for(;i+PacketSize<=n;i+=PacketSize) pstore(out+i, pmul(pload(a+i), pload(b+i)));
+  for(;i<n;++i) out[i] = a[i] * b[i];
+}
+
+//! out = a / b
+inline void div(const real* a, const real* b, real* out, size_t n) {
+  size_t i=0;
+  for(;i+PacketSize<=n;i+=PacketSize) pstore(out+i, pdiv(pload(a+i), pload(b+i)));
+  for(;i<n;++i) out[i] = a[i] / b[i];
+}
+
+//! out = 1 / a
+inline void reciprocal(const real* a, real* out, size_t n) {
+  size_t i=0;
+  const Packet one = pset1(static_cast<real>(1));
+  for(;i+PacketSize<=n;i+=PacketSize) pstore(out+i, pdiv(one, pload(a+i)));
+  for(;i<n;++i) out[i] = static_cast<real>(1) / a[i];
+}
+
+//! out = a > 0 ? 1 : 0
+inline void step(const real* a, real* out, size_t n) {
+  size_t i=0;
+  for(;i+PacketSize<=n;i+=PacketSize) pstore(out+i, pstep(pload(a+i)));
+  for(;i<n;++i) out[i] = a[i] > 0 ? static_cast<real>(1) : static_cast<real>(0);
+}
+
+//! out[i] = v[i] * s[i] for an array of n packed Vec3 v and n reals s
+inline void scale3(const real* v, const real* s, real* out, size_t n) {
+  size_t i=0;
+#if defined(__SSE2__)
+  // Four Vec3 span exactly three SSE registers; broadcast the matching scales
+  for(;i+4<=n;i+=4) {
+    const __m128 S = _mm_loadu_ps(s+i);
+    const real* vi = v + 3*i;
+    real* oi = out + 3*i;
+    _mm_storeu_ps(oi,   _mm_mul_ps(_mm_loadu_ps(vi),   _mm_shuffle_ps(S, S, _MM_SHUFFLE(1,0,0,0))));
+    _mm_storeu_ps(oi+4, _mm_mul_ps(_mm_loadu_ps(vi+4), _mm_shuffle_ps(S, S, _MM_SHUFFLE(2,2,1,1))));
+    _mm_storeu_ps(oi+8, _mm_mul_ps(_mm_loadu_ps(vi+8), _mm_shuffle_ps(S, S, _MM_SHUFFLE(3,3,3,2))));
+  }
+#endif
+  for(;i<n;++i)
+  { out[3*i] = v[3*i] * s[i]; out[3*i+1] = v[3*i+1] * s[i]; out[3*i+2] = v[3*i+2] * s[i]; }
+}
+
+//! out = sqrt(x*x + y*y + z*z)
+inline void length(const real* x, const real* y, const real* z, real* out, size_t n) {
+  size_t i=0;
+  for(;i+PacketSize<=n;i+=PacketSize) {
+    Packet X = pload(x+i), Y = pload(y+i), Z = pload(z+i);
+    pstore(out+i, psqrt(padd(padd(pmul(X,X), pmul(Y,Y)), pmul(Z,Z))));
+  }
+  for(;i<n;++i) out[i] = std::sqrt(x[i]*x[i] + y[i]*y[i] + z[i]*z[i]);
+}
+
+//! out = a . b
+inline void dot(const SoABlock& a, const SoABlock& b, real* out, size_t n) {
+  size_t i=0;
+  for(;i+PacketSize<=n;i+=PacketSize) {
+    Packet X = pmul(pload(a.x+i), pload(b.x+i));
+    Packet Y = pmul(pload(a.y+i), pload(b.y+i));
+    Packet Z = pmul(pload(a.z+i), pload(b.z+i));
+    pstore(out+i, padd(padd(X, Y), Z));
+  }
+  for(;i<n;++i) out[i] = a.x[i]*b.x[i] + a.y[i]*b.y[i] + a.z[i]*b.z[i];
+}
+
+//! out = a x b
+inline void cross(const SoABlock& a, const SoABlock& b, SoABlock& out, size_t n) {
+  size_t i=0;
+  for(;i+PacketSize<=n;i+=PacketSize) {
+    Packet ax = pload(a.x+i), ay = pload(a.y+i), az = pload(a.z+i);
+    Packet bx = pload(b.x+i), by = pload(b.y+i), bz = pload(b.z+i);
+    pstore(out.x+i, psub(pmul(ay,bz), pmul(az,by)));
+    pstore(out.y+i, psub(pmul(az,bx), pmul(ax,bz)));
+    pstore(out.z+i, psub(pmul(ax,by), pmul(ay,bx)));
+  }
+  for(;i<n;++i) {
+    out.x[i] = a.y[i]*b.z[i] - a.z[i]*b.y[i];
+    out.y[i] = a.z[i]*b.x[i] - a.x[i]*b.z[i];
+    out.z[i] = a.x[i]*b.y[i] - a.y[i]*b.x[i];
+  }
+}
+
+//! Maps world points xs onto a lattice with origin o and inverse spacing
+//! hinv: cell receives floor((x-o)*hinv) and frac the remainder, per axis
+inline void lattice(const Vec3* xs, const Vec3& o, const Vec3& hinv, SoABlock& cell, SoABlock& frac, size_t n) {
+  frac.load(xs, n);
+  real* r[3] = { frac.x, frac.y, frac.z };
+  real* c[3] = { cell.x, cell.y, cell.z };
+  for(int d=0;d<3;++d) {
+    size_t i=0;
+    const Packet O = pset1(o[d]), Hinv = pset1(hinv[d]);
+    for(;i+PacketSize<=n;i+=PacketSize) {
+      Packet R = pmul(psub(pload(r[d]+i), O), Hinv);
+      Packet C = pfloor(R);
+      pstore(c[d]+i, C);
+      pstore(r[d]+i, psub(R, C));
+    }
+    for(;i<n;++i) {
+      real R = (r[d][i] - o[d]) * hinv[d];
+      c[d][i] = std::floor(R);
+      r[d][i] = R - c[d][i];
+    }
+  }
+}
+
+};
+};
+#endif
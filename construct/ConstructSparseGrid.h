@@ -0,0 +1,246 @@
+#ifndef ConstructSparseGrid_h
+#define ConstructSparseGrid_h
+#include "construct/ConstructField.h"
+#include "construct/ConstructDomain.h"
+#include "construct/ConstructGrid.h"
+#include <vector>
+#include <memory>
+#include <algorithm>
+namespace Construct {
+
+//////////////////////////////////////////////////////////
+//! A gridded field which stores only the parts of the lattice that differ
+//! from a background value. The lattice is split into 8^3 leaves, grouped
+//! 4^3 to a tile; a dense root table points to tiles, and tiles to
+//! leaves. Tiles and leaves exist only where some voxel is active, so
+//! memory follows the active region rather than the domain box.
+//! Everywhere else, outside the domain too, the field is the background.
+template<typename T>
+struct SparseGrid : public ConstructFieldNode<T> {
+	enum { Leaf = 8, LeafVolume = Leaf * Leaf * Leaf, Tile = 4, TileLeaves = Tile * Tile * Tile };
+
+	struct TileNode {
+		std::unique_ptr<T[]> leaves[TileLeaves];
+	};
+
+	Domain domain;
+	T background;
+	int leafCount[3], tileCount[3]; //! Leaves and tiles per axis
+	std::vector<std::unique_ptr<TileNode> > root;
+
+	SparseGrid(Domain domain, const T& background) : domain(domain), background(background) {
+		for(int a=0;a<3;++a) {
+			leafCount[a] = (domain.res[a] + Leaf - 1) / Leaf;
+			tileCount[a] = (leafCount[a] + Tile - 1) / Tile;
+		}
+		root.resize((size_t)tileCount[0] * tileCount[1] * tileCount[2]);
+	}
+
+	//! Root slot of the tile holding leaf (li,lj,lk), and the leaf's slot in it
+	inline int tileIndex(int li, int lj, int lk) const
+	{ return ((lk / Tile) * tileCount[1] + lj / Tile) * tileCount[0] + li / Tile; }
+	static inline int leafIndex(int li, int lj, int lk)
+	{ return ((lk % Tile) * Tile + lj % Tile) * Tile + li % Tile; }
+	static inline int voxelIndex(int i, int j, int k)
+	{ return ((k % Leaf) * Leaf + j % Leaf) * Leaf + i % Leaf; }
+
+	//! Values of the leaf holding lattice point (i,j,k), or null if inactive
+	inline const T* leaf(int i, int j, int k) const {
+		const TileNode* t = root[tileIndex(i / Leaf, j / Leaf, k / Leaf)].get();
+		return t ? t->leaves[leafIndex(i / Leaf, j / Leaf, k / Leaf)].get() : NULL;
+	}
+
+	//! Value at lattice point (i,j,k)
+	inline T get(int i, int j, int k) const {
+		if(!domain.inside(i,j,k)) return background;
+		const T* l = leaf(i,j,k);
+		return l ? l[voxelIndex(i,j,k)] : background;
+	}
+
+	//! Set lattice point (i,j,k), activating its leaf
+	void set(int i, int j, int k, const T& value) {
+		activate(i / Leaf, j / Leaf, k / Leaf)[voxelIndex(i,j,k)] = value;
+	}
+
+	//! Values of leaf (li,lj,lk), allocating it (filled with the background) if needed
+	T* activate(int li, int lj, int lk) {
+		std::unique_ptr<TileNode>& t = root[tileIndex(li, lj, lk)];
+		if(!t) t.reset(new TileNode());
+		std::unique_ptr<T[]>& l = t->leaves[leafIndex(li, lj, lk)];
+		if(!l) {
+			l.reset(new T[LeafVolume]);
+			std::fill(l.get(), l.get() + LeafVolume, background);
+		}
+		return l.get();
+	}
+
+	//! Number of allocated leaves; each holds LeafVolume values
+	size_t activeLeaves() const {
+		size_t n = 0;
+		for(size_t t=0;t<root.size();++t) if(root[t])
+			for(int l=0;l<TileLeaves;++l) n += root[t]->leaves[l] ? 1 : 0;
+		return n;
+	}
+
+	//! Calls f(i,j,k,value) for every lattice point of every active leaf
+	template<typename F>
+	void forEachActive(F f) const {
+		for(int lk=0;lk<leafCount[2];++lk)
+		for(int lj=0;lj<leafCount[1];++lj)
+		for(int li=0;li<leafCount[0];++li) {
+			const T* l = leaf(li * Leaf, lj * Leaf, lk * Leaf);
+			if(!l) continue;
+			for(int k=lk*Leaf;k<std::min((lk+1)*Leaf, domain.res[2]);++k)
+			for(int j=lj*Leaf;j<std::min((lj+1)*Leaf, domain.res[1]);++j)
+			for(int i=li*Leaf;i<std::min((li+1)*Leaf, domain.res[0]);++i)
+				f(i, j, k, l[voxelIndex(i,j,k)]);
+		}
+	}
+
+	//! True for leaves of this grid that are active, or within dilation
+	//! leaves of an active one
+	std::vector<char> band(int dilation) const {
+		std::vector<char> mask((size_t)leafCount[0] * leafCount[1] * leafCount[2], 0);
+		for(int lk=0;lk<leafCount[2];++lk)
+		for(int lj=0;lj<leafCount[1];++lj)
+		for(int li=0;li<leafCount[0];++li) {
+			if(!leaf(li * Leaf, lj * Leaf, lk * Leaf)) continue;
+			for(int k=std::max(lk-dilation,0);k<=std::min(lk+dilation,leafCount[2]-1);++k)
+			for(int j=std::max(lj-dilation,0);j<=std::min(lj+dilation,leafCount[1]-1);++j)
+			for(int i=std::max(li-dilation,0);i<=std::min(li+dilation,leafCount[0]-1);++i)
+				mask[(k * leafCount[1] + j) * leafCount[0] + i] = 1;
+		}
+		return mask;
+	}
+
+	//! Evaluate source over the leaves selected by mask (all leaves if
+	//! empty), keeping only leaves where it differs from the background.
+	//! Tiles are baked in parallel, each by one thread.
+	void bakeData(typename ConstructFieldNode<T>::ptr source, const std::vector<char>& mask = std::vector<char>()) {
+		const CompiledField<T> program(source);
+		#pragma omp parallel
+		{
+			std::vector<Vec3> xs(LeafVolume);
+			std::vector<T> values(LeafVolume);
+			#pragma omp for schedule(dynamic)
+			for(int t=0;t<(int)root.size();++t) {
+				root[t].reset();
+				const int ti = t % tileCount[0], tj = t / tileCount[0] % tileCount[1], tk = t / (tileCount[0] * tileCount[1]);
+				for(int lk=tk*Tile;lk<std::min((tk+1)*Tile, leafCount[2]);++lk)
+				for(int lj=tj*Tile;lj<std::min((tj+1)*Tile, leafCount[1]);++lj)
+				for(int li=ti*Tile;li<std::min((ti+1)*Tile, leafCount[0]);++li) {
+					if(!mask.empty() && !mask[(lk * leafCount[1] + lj) * leafCount[0] + li]) continue;
+					bakeLeaf(program, li, lj, lk, &xs[0], &values[0]);
+				}
+			}
+		}
+	}
+
+	T eval(const Vec3& x) const {
+		const Vec3 relative = (x - domain.bmin).cwiseProduct(domain.Hinverse);
+		const int i = (int)floor(relative[0]), j = (int)floor(relative[1]), k = (int)floor(relative[2]);
+		const Vec3 w = relative - Vec3(i,j,k);
+		return trilinear(i, j, k, w[0], w[1], w[2]);
+	}
+
+	//! Trilinear blend over the cell with lower corner (i,j,k). A cell
+	//! within one leaf costs a single lookup; inactive leaves are the
+	//! background without reading any values.
+	inline T trilinear(int i, int j, int k, real wx, real wy, real wz) const {
+		if((unsigned)i < (unsigned)(domain.res[0]-1) && i % Leaf < Leaf-1 &&
+			 (unsigned)j < (unsigned)(domain.res[1]-1) && j % Leaf < Leaf-1 &&
+			 (unsigned)k < (unsigned)(domain.res[2]-1) && k % Leaf < Leaf-1) {
+			const T* l = leaf(i,j,k);
+			return l ? ConstructGrid<T>::blend(l + voxelIndex(i,j,k), Leaf, Leaf * Leaf, wx, wy, wz) : background;
+		}
+		const int i1 = i+1, j1 = j+1, k1 = k+1;
+		const T c[8] = { get(i,j,k), get(i1,j,k), get(i,j1,k), get(i1,j1,k),
+			get(i,j,k1), get(i1,j,k1), get(i,j1,k1), get(i1,j1,k1) };
+		return ConstructGrid<T>::blend(c, 2, 4, wx, wy, wz);
+	}
+
+	void evalBlock(const Vec3* xs, T* out, size_t n) const {
+		SoABlock cell, w;
+		simd::lattice(xs, domain.bmin, domain.Hinverse, cell, w, n);
+		for(size_t s=0;s<n;++s)
+			out[s] = trilinear((int)cell.x[s], (int)cell.y[s], (int)cell.z[s], w.x[s], w.y[s], w.z[s]);
+	}
+
+	//! Compiled programs sample the grid without going through the vtable
+	static void sampleBlock(const void* grid, const Vec3* xs, void* out, size_t n)
+	{ static_cast<const SparseGrid*>(grid)->SparseGrid::evalBlock(xs, static_cast<T*>(out), n); }
+	int compile(FieldCompiler& c, int x) const
+	{ return c.leaf<T>(Register<T>::Sample, this, &sampleBlock, x); }
+
+	typename FieldInfo<T>::GradType grad(const Vec3& x) const {
+		throw std::logic_error("Gradient of Matrix Field not supported");
+		return FieldInfo<typename FieldInfo<T>::GradType>::Zero();
+	}
+
+private:
+	//! Evaluates leaf (li,lj,lk), storing it only if some voxel is not the background
+	void bakeLeaf(const CompiledField<T>& program, int li, int lj, int lk, Vec3* xs, T* values) {
+		const int i0 = li * Leaf, j0 = lj * Leaf, k0 = lk * Leaf;
+		for(int k=0;k<Leaf;++k)
+		for(int j=0;j<Leaf;++j)
+		for(int i=0;i<Leaf;++i)
+			xs[(k * Leaf + j) * Leaf + i] = domain.position(i0+i, j0+j, k0+k);
+		evalBlocks(program, xs, values, LeafVolume);
+
+		bool active = false;
+		for(int k=0;k<Leaf;++k)
+		for(int j=0;j<Leaf;++j)
+		for(int i=0;i<Leaf;++i) {
+			T& v = values[(k * Leaf + j) * Leaf + i];
+			if(!domain.inside(i0+i, j0+j, k0+k)) v = background;
+			else if(!(v == background)) active = true;
+		}
+		if(active) std::copy(values, values + LeafVolume, activate(li, lj, lk));
+	}
+};
+
+// Sparse grid gradient operators, as for dense grids
+template<> Vec3 SparseGrid<real>::grad(const Vec3& x) const
+{
+	const Vec3 &dx(domain.H);
+	Vec3 result;
+	result[0] = (eval(x + Vec3(dx[0],0,0)) - eval(x - Vec3(dx[0],0,0))) / (2 * dx[0]);
+	result[1] = (eval(x + Vec3(0,dx[1],0)) - eval(x - Vec3(0,dx[1],0))) / (2 * dx[1]);
+	result[2] = (eval(x + Vec3(0,0,dx[2])) - eval(x - Vec3(0,0,dx[2]))) / (2 * dx[2]);
+	return result;
+}
+
+template<> Mat3 SparseGrid<Vec3>::grad(const Vec3& x) const
+{
+	const Vec3 &dx(domain.H);
+	Mat3 result;
+	result.row(0) = (eval(x + Vec3(dx[0],0,0)) - eval(x - Vec3(dx[0],0,0))) / (2 * dx[0]);
+	result.row(1) = (eval(x + Vec3(0,dx[1],0)) - eval(x - Vec3(0,dx[1],0))) / (2 * dx[1]);
+	result.row(2) = (eval(x + Vec3(0,0,dx[2])) - eval(x - Vec3(0,0,dx[2]))) / (2 * dx[2]);
+	return result;
+}
+
+//! Bake a field into a sparse grid, storing only leaves where it differs
+//! from the background
+template<typename T>
+inline Field<T> writeToSparseGrid(Field<T> field, const T& background, Domain domain) {
+	SparseGrid<T>* grid = new SparseGrid<T>(domain, background);
+	grid->bakeData(field.node);
+	return Field<T>(grid);
+}
+
+//! As above, evaluating only within dilation leaves of the active leaves
+//! of band, which must be a sparse grid on the same domain. Advected
+//! fields stay near where they were, so this keeps the cost of a step
+//! proportional to the active region too.
+template<typename T, typename U>
+inline Field<T> writeToSparseGrid(Field<T> field, const T& background, Field<U> band, int dilation = 1) {
+	const SparseGrid<U>* b = dynamic_cast<const SparseGrid<U>*>(band.node.get());
+	if(!b) throw std::logic_error("writeToSparseGrid() needs a sparse grid for its band.");
+	SparseGrid<T>* grid = new SparseGrid<T>(b->domain, background);
+	grid->bakeData(field.node, b->band(dilation));
+	return Field<T>(grid);
+}
+
+};
+#endif
@@ -0,0 +1,143 @@
+#ifndef ConstructStorage_h
+#define ConstructStorage_h
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <limits>
+#include "construct/ConstructBase.h"
+#include "construct/ConstructSIMD.h"
+
+#if defined(__F16C__)
+#include <immintrin.h>
+#endif
+
+namespace Construct {
+
+//////////////////////////////////////////////////////////
+// Storage policies for grid values. Each stores the real components of a
+// value as Scalar, decoded on every read. Quantized policies spread their
+// integer levels over one range per grid, offset + scale * q.
+
+//! Full precision, the values themselves
+struct StoreFloat {
+  typedef real Scalar;
+  enum { Quantized = 0 };
+  static inline real decode(Scalar q, real scale, real offset) { return q; }
+  static inline Scalar encode(real v, real scale, real offset) { return v; }
+  static inline void range(real lo, real hi, real& scale, real& offset) { scale = 1; offset = 0; }
+};
+
+//! IEEE half precision: 11 significant bits, range +-65504
+struct StoreHalf {
+  typedef uint16_t Scalar;
+  enum { Quantized = 0 };
+
+  //! Branch-light conversions, rounding to nearest even
+  static inline real decode(Scalar h, real scale, real offset) {
+    uint32_t u = (uint32_t)(h & 0x7fff) << 13;
+    const uint32_t exponent = u & (0x7c00 << 13);
+    u += (127 - 15) << 23;
+    if(exponent == (0x7c00 << 13)) u += (128 - 16) << 23;   // Inf, NaN
+    else if(exponent == 0) {                                // Subnormal
+      u += 1 << 23;
+      const uint32_t magicBits = 113 << 23;
+      float f, magic;
+      memcpy(&f, &u, 4); memcpy(&magic, &magicBits, 4);
+      f -= magic;
+      memcpy(&u, &f, 4);
+    }
+    u |= (uint32_t)(h & 0x8000) << 16;
+    float f;
+    memcpy(&f, &u, 4);
+    return f;
+  }
+  //! n at once, four per instruction where the build enables F16C
+  static inline void decode(const Scalar* h, real* r, size_t n, real scale, real offset) {
+    size_t c = 0;
+#if defined(__F16C__)
+    for(;c+4<=n;c+=4) _mm_storeu_ps(r+c, _mm_cvtph_ps(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(h+c))));
+#endif
+    for(;c<n;++c) r[c] = decode(h[c], scale, offset);
+  }
+  static inline Scalar encode(real v, real scale, real offset) {
+    float f = v;
+    uint32_t u;
+    memcpy(&u, &f, 4);
+    const uint32_t sign = u & 0x80000000u;
+    u ^= sign;
+    Scalar h;
+    if(u >= (uint32_t)(127 + 16) << 23) h = u > (uint32_t)255 << 23 ? 0x7e00 : 0x7c00;
+    else if(u < (uint32_t)113 << 23) {
+      const uint32_t magicBits = ((127 - 15) + (23 - 10) + 1) << 23;
+      float magic;
+      memcpy(&f, &u, 4); memcpy(&magic, &magicBits, 4);
+      f += magic;
+      memcpy(&u, &f, 4);
+      h = (Scalar)(u - magicBits);
+    } else {
+      const uint32_t odd = (u >> 13) & 1;
+      u += ((uint32_t)(15 - 127) << 23) + 0xfff + odd;
+      h = (Scalar)(u >> 13);
+    }
+    return h | (Scalar)(sign >> 16);
+  }
+  static inline void range(real lo, real hi, real& scale, real& offset) { scale = 1; offset = 0; }
+};
+
+//! Unsigned integers over a per-grid range
+template<typename Int>
+struct StoreFixed {
+  typedef Int Scalar;
+  enum { Quantized = 1 };
+  static inline real levels() { return (real)std::numeric_limits<Int>::max(); }
+  static inline real decode(Scalar q, real scale, real offset) { return offset + scale * q; }
+  static inline void decode(const Scalar* q, real* r, size_t n, real scale, real offset)
+  { for(size_t c=0;c<n;++c) r[c] = offset + scale * q[c]; }
+  static inline Scalar encode(real v, real scale, real offset) {
+    const real q = std::floor((v - offset) / scale + (real).5);
+    return (Scalar)(q < 0 ? 0 : q > levels() ? levels() : q);
+  }
+  //! Values outside [lo, hi] are clamped to it when encoded
+  static inline void range(real lo, real hi, real& scale, real& offset) {
+    offset = lo;
+    scale = hi > lo ? (hi - lo) / levels() : 1;
+  }
+};
+typedef StoreFixed<uint16_t> StoreUInt16;
+typedef StoreFixed<uint8_t> StoreUInt8;
+
+//! The components of one value in storage
+template<typename Scalar, int N>
+struct Packed { Scalar s[N]; };
+
+//! How values of type T are held and converted under storage policy S
+template<typename T, typename S>
+struct Storage {
+  typedef Packed<typename S::Scalar, Scalars<T>::Count> Stored;
+  static inline T decode(const Stored& q, real scale, real offset) {
+    T v;
+    real* r = Scalars<T>::ptr(&v);
+    for(int c=0;c<Scalars<T>::Count;++c) r[c] = S::decode(q.s[c], scale, offset);
+    return v;
+  }
+  static inline Stored encode(const T& v, real scale, real offset) {
+    Stored q;
+    const real* r = Scalars<T>::ptr(&v);
+    for(int c=0;c<Scalars<T>::Count;++c) q.s[c] = S::encode(r[c], scale, offset);
+    return q;
+  }
+  //! Decodes n values at once, as one flat run of components
+  static inline void decode(const Stored* q, T* out, size_t n, real scale, real offset)
+  { S::decode(q[0].s, Scalars<T>::ptr(out), n * Scalars<T>::Count, scale, offset); }
+};
+template<typename T>
+struct Storage<T, StoreFloat> {
+  typedef T Stored;
+  static inline const T& decode(const T& q, real scale, real offset) { return q; }
+  static inline const T& encode(const T& v, real scale, real offset) { return v; }
+  static inline void decode(const T* q, T* out, size_t n, real scale, real offset)
+  { for(size_t i=0;i<n;++i) out[i] = q[i]; }
+};
+
+};
+#endif
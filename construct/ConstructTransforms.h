@@ -1,6 +1,7 @@
 #ifndef ConstructTransforms_h
 #define ConstructTransforms_h
 #include "construct/ConstructField.h"
+#include "construct/ConstructAlgebra.h"
 namespace Construct {
 
 // Translate
@@ -15,12 +16,53 @@ struct TranslateField : public ConstructFieldNode<T> {
     Vec3 trans = translation->eval(x);
     return field->eval(x - trans);
   }
-  typename FieldInfo<T>::GradType grad(const Vec3& x) const {
-    typename FieldInfo<T>::GradType fprime = 
-      field->grad(x-translation->eval(x));
-    return fprime - translation->grad(x) * fprime;
+  void evalBlock(const Vec3* xs, T* out, size_t n) const {
+    Vec3 ys[BlockSize];
+    translation->evalBlock(xs, ys, n);
+    for(size_t i=0;i<n;++i) ys[i] = xs[i] - ys[i];
+    field->evalBlock(ys, out, n);
+  }
+  int compile(FieldCompiler& c, int x) const {
+    const int t = c.lower(*translation, x);
+    return c.lower(*field, c.emit<Vec3>(OpSubV, x, t));
+  }
+  int compileGrad(FieldCompiler& c, int x) const;
+  void shape(FieldShape& s) const
+  { s(field); s(translation); }
+  //! Translation by an affine map (e.g. a constant) is the affine warp
+  //! x -> x - (A*x + b), which may then collapse with warps inside field
+  typename ConstructFieldNode<T>::ptr simplify(FieldSimplifier& s) const {
+    typedef typename ConstructFieldNode<T>::ptr Ptr;
+    const Ptr f = s(field);
+    const VFNodePtr t = s(translation);
+    if(s.constant(f) || s.zero(t)) return f;
+    Mat3 A;
+    Vec3 b;
+    if(asAffine(t, A, b)) return collapseAffineWarp<T>(f, Mat3(Mat3::Identity() - A), Vec3(-b));
+    return f == field && t == translation ? Ptr() : adopt(new TranslateField<T>(f, t));
+  }
+  typename FieldInfo<T>::GradType grad(const Vec3& x) const
+  { return evalWithGrad(x).grad; }
+  ValueAndGrad<T> evalWithGrad(const Vec3& x) const {
+    const ValueAndGrad<Vec3> t = translation->evalWithGrad(x);
+    const ValueAndGrad<T> f = field->evalWithGrad(x - t.value);
+    return ValueAndGrad<T>(f.value, f.grad - t.grad * f.grad);
   }
 };
+template<typename T>
+int TranslateField<T>::compileGrad(FieldCompiler& c, int x) const
+{ return c.callGrad(this, x); }
+template<> int TranslateField<real>::compileGrad(FieldCompiler& c, int x) const {
+  const int t = c.lower(*translation, x), tg = c.lowerGrad(*translation, x);
+  const int fprime = c.lowerGrad(*field, c.emit<Vec3>(OpSubV, x, t));
+  return c.emit<Vec3>(OpSubV, fprime, c.emit<Vec3>(OpMulMV, tg, fprime));
+}
+template<> int TranslateField<Vec3>::compileGrad(FieldCompiler& c, int x) const {
+  const int t = c.lower(*translation, x), tg = c.lowerGrad(*translation, x);
+  const int fprime = c.lowerGrad(*field, c.emit<Vec3>(OpSubV, x, t));
+  return c.emit<Mat3>(OpSubM, fprime, c.emit<Mat3>(OpMulMM, tg, fprime));
+}
+
 template<typename T>
 inline Field<T> translate(Field<T> field, VectorField translation)
 { return Field<T>(new TranslateField<T>(field.node, translation.node)); }
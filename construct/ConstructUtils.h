@@ -1,6 +1,7 @@
 #ifndef ConstructUtils_h
 #define ConstructUtils_h
 #include "construct/ConstructField.h"
+#include "construct/ConstructSIMD.h"
 namespace Construct {
 
 struct MaskField : public ScalarFieldNode {
@@ -9,6 +10,21 @@ struct MaskField : public ScalarFieldNode {
 	real eval(const Vec3& x) const {
 		return field->eval(x) > 0 ? static_cast<real>(1) : static_cast<real>(0);
 	}
+	void evalBlock(const Vec3* xs, real* out, size_t n) const {
+		field->evalBlock(xs, out, n);
+		simd::step(out, out, n);
+	}
+	int compile(FieldCompiler& c, int x) const
+	{ return c.emit<real>(OpMask, c.lower(*field, x)); }
+	int compileGrad(FieldCompiler& c, int x) const
+	{ return c.constant(Vec3(0,0,0)); }
+	void shape(FieldShape& s) const
+	{ s(field); }
+	SFNodePtr simplify(FieldSimplifier& s) const {
+		const SFNodePtr f = s(field);
+		if(s.constant(f)) return s.fold<real>(new MaskField(f));
+		return f == field ? SFNodePtr() : adopt(new MaskField(f));
+	}
 
 	// This is not technically differentiable...
 	// Excepting the borders where there is an infinite derivative,
@@ -27,12 +43,31 @@ struct AbsoluteValueField : public ConstructFieldNode<T> {
 	Ptr field;
 	AbsoluteValueField(Ptr field) : field(field) { }
 	T eval(const Vec3& x) const { return field->eval(x).cwiseAbs(); }
+	void evalBlock(const Vec3* xs, T* out, size_t n) const {
+		field->evalBlock(xs, out, n);
+		for(size_t i=0;i<n;++i) out[i] = out[i].cwiseAbs();
+	}
+	int compile(FieldCompiler& c, int x) const
+	{ return c.emit<T>(Register<T>::Abs, c.lower(*field, x)); }
+	int compileGrad(FieldCompiler& c, int x) const
+	{ return c.constant(FieldInfo<typename FieldInfo<T>::GradType>::Zero()); }
+	void shape(FieldShape& s) const
+	{ s(field); }
+	Ptr simplify(FieldSimplifier& s) const {
+		const Ptr f = s(field);
+		if(s.constant(f)) return s.fold<T>(new AbsoluteValueField<T>(f));
+		return f == field ? Ptr() : adopt(new AbsoluteValueField<T>(f));
+	}
 	typename FieldInfo<T>::GradType grad(const Vec3& x) const
 	{ return FieldInfo<typename FieldInfo<T>::GradType>::Zero(); }
 	// TODO: Implement grad(abs)
 };
 template<> real AbsoluteValueField<real>::eval(const Vec3& x) 
 const { return abs(field->eval(x)); }
+template<> void AbsoluteValueField<real>::evalBlock(const Vec3* xs, real* out, size_t n) const {
+	field->evalBlock(xs, out, n);
+	for(size_t i=0;i<n;++i) out[i] = abs(out[i]);
+}
 
 template<typename T> inline Field<T> abs(Field<T> field)
 { return Field<T>(new AbsoluteValueField<T>(field.node)); }